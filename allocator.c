@@ -0,0 +1,41 @@
+#include "allocator.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+void* __system_allocate(void* context, size_t size) {
+    (void) context;
+    stats_add(STATS_allocations, 1);
+    stats_add(STATS_bytes_allocated, size);
+    return malloc(size);
+}
+
+void* __system_reallocate(void* context, void* data, size_t size) {
+    (void) context;
+    stats_add(STATS_reallocations, 1);
+    stats_add(STATS_bytes_allocated, size);
+    return realloc(data, size);
+}
+
+void __system_release(void* context, void* data) {
+    (void) context;
+    stats_add(STATS_releases, data != NULL);
+    free(data);
+}
+
+void __system_out_of_memory(void* context, const char* what) {
+    (void) context;
+    fprintf(stderr, "Could not %s\n", what);
+    abort();
+}
+
+const Allocator SYSTEM_ALLOCATOR = {
+    .hooks = {__system_allocate, __system_reallocate, __system_release, NULL},
+    .out_of_memory = __system_out_of_memory,
+    .context = NULL,
+};
+
+void out_of_memory(const Allocator* allocator, const char* what) {
+    allocator->out_of_memory(allocator->context, what);
+    abort();
+}
@@ -0,0 +1,33 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stddef.h>
+#include "ccalc.h"
+
+// Where a structure gets its memory. When the hooks run out,
+// out_of_memory() is told what could not be done ("allocate ...") and
+// must not return
+typedef struct {
+    CCalcAllocator hooks;
+    void (*out_of_memory)(void* context, const char* what);
+    void* context; // of out_of_memory
+} Allocator;
+
+// malloc() and friends, printing what could not be done and aborting
+extern const Allocator SYSTEM_ALLOCATOR;
+
+static inline void* allocate(const Allocator* allocator, size_t size) {
+    return allocator->hooks.allocate(allocator->hooks.context, size);
+}
+
+static inline void* reallocate(const Allocator* allocator, void* data, size_t size) {
+    return allocator->hooks.reallocate(allocator->hooks.context, data, size);
+}
+
+static inline void release(const Allocator* allocator, void* data) {
+    allocator->hooks.release(allocator->hooks.context, data);
+}
+
+void out_of_memory(const Allocator* allocator, const char* what) __attribute__((noreturn));
+
+#endif /* ALLOCATOR_H */
@@ -0,0 +1,595 @@
+#include "interpreter.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "output.h"
+#include "program.h"
+#include "stack.h"
+#include "verifier.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Benchmarks of the lexer, the interpreter, the numstack and printing on
+// generated workloads. Workloads only depend on the seed and the size, so
+// results of different builds on one machine can be compared
+
+// Generated workloads, each a line at a time until the size is reached
+#define WORKLOAD_LIST \
+    X(numbers, "long number literals summed, a print per line") \
+    X(operators, "single digits under every operator") \
+    X(deep, "512 values pushed before they are summed") \
+    X(comments, "every number followed by a comment word") \
+    X(prints, "every number printed")
+
+typedef enum {
+#define X(name, description) \
+    WORKLOAD_##name,
+    WORKLOAD_LIST
+#undef X
+    WORKLOAD_COUNT
+} Workload;
+
+const char* const WORKLOAD_NAMES[/*Workload*/] = {
+#define X(name, description) \
+    [WORKLOAD_##name] = #name,
+    WORKLOAD_LIST
+#undef X
+};
+
+const char* const WORKLOAD_DESCRIPTIONS[/*Workload*/] = {
+#define X(name, description) \
+    [WORKLOAD_##name] = description,
+    WORKLOAD_LIST
+#undef X
+};
+
+// As the ccalc executable batches tokens
+const size_t BENCH_BATCH_SIZE = 1 << 16;
+const size_t NUMSTACK_BENCH_VALUES = 1 << 20;
+// Pushed on a new stack, which grows all the way
+const size_t NUMSTACK_GROW_VALUES = 1 << 25;
+const size_t PRINT_BENCH_VALUES = 1 << 20;
+const size_t DEEP_WORKLOAD_DEPTH = 512;
+#define MAX_RESULTS 64
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} Text;
+
+void __text_append(Text* text, const char* data, size_t len) {
+    if (text->len + len > text->cap) {
+        size_t cap = text->cap ? text->cap : 1 << 16;
+        while (text->len + len > cap)
+            cap *= 2;
+        char* new_data = realloc(text->data, cap);
+        if (!new_data) {
+            fprintf(stderr, "Could not expand workload\n");
+            abort();
+        }
+        text->data = new_data;
+        text->cap = cap;
+    }
+    memcpy(text->data + text->len, data, len);
+    text->len += len;
+}
+
+void __text_append_string(Text* text, const char* string) {
+    __text_append(text, string, strlen(string));
+}
+
+// xorshift64*, the same sequence everywhere
+uint64_t __next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+size_t __random_below(uint64_t* state, size_t n) {
+    return __next_random(state) % n;
+}
+
+// A positive literal the build's number type reads: integers only for
+// int64, no exponents for fixed point
+void __append_literal(Text* text, uint64_t* random, size_t max_int_digits) {
+    char literal[64];
+    size_t len = 0;
+    size_t int_digits = 1 + __random_below(random, max_int_digits);
+    literal[len++] = '1' + __random_below(random, 9);
+    for (size_t i = 1; i < int_digits; i++)
+        literal[len++] = '0' + __random_below(random, 10);
+#if NUMBER_BACKEND != NUMBER_BACKEND_INT64
+    if (max_int_digits > 1 && __random_below(random, 2)) {
+        literal[len++] = '.';
+        size_t frac_digits = 1 + __random_below(random, 6);
+        for (size_t i = 0; i < frac_digits; i++)
+            literal[len++] = '0' + __random_below(random, 10);
+    }
+#endif
+#if NUMBER_IS_FLOATING
+    if (max_int_digits > 1 && __random_below(random, 8) == 0)
+        len += snprintf(literal + len, sizeof(literal) - len, "e%s%zu",
+                        __random_below(random, 2) ? "-" : "", __random_below(random, 10));
+#endif
+    __text_append(text, literal, len);
+}
+
+// Letters a comment may start with, an 'e' would begin a number
+const char COMMENT_LETTERS[] = "abcdfghijklmnopqrstuvwxyz";
+
+void __append_comment(Text* text, uint64_t* random) {
+    char word[16];
+    size_t len = 3 + __random_below(random, 10);
+    for (size_t i = 0; i < len; i++)
+        word[i] = COMMENT_LETTERS[__random_below(random, sizeof(COMMENT_LETTERS) - 1)];
+    __text_append(text, word, len);
+}
+
+// Every line leaves the stack as it found it, and values stay small
+// enough for integer builds not to overflow
+void __generate_line(Text* text, Workload workload, uint64_t* random) {
+    const char* const OPERATORS[] = {" +", " -", " *", " /"};
+    switch (workload) {
+    case WORKLOAD_numbers:
+        __append_literal(text, random, 6);
+        for (size_t i = 1; i < 64; i++) {
+            __text_append_string(text, " ");
+            __append_literal(text, random, 6);
+            __text_append_string(text, " +");
+        }
+        break;
+    case WORKLOAD_operators:
+        __append_literal(text, random, 1);
+        for (size_t i = 0; i < 32; i++) {
+            __text_append_string(text, " ");
+            __append_literal(text, random, 1);
+            __text_append_string(text, " ");
+            __append_literal(text, random, 1);
+            __text_append_string(text, OPERATORS[__random_below(random, 4)]);
+            __text_append_string(text, OPERATORS[__random_below(random, 2)]);
+        }
+        break;
+    case WORKLOAD_deep:
+        for (size_t i = 0; i < DEEP_WORKLOAD_DEPTH; i++) {
+            __append_literal(text, random, 2);
+            __text_append_string(text, " ");
+        }
+        for (size_t i = 1; i < DEEP_WORKLOAD_DEPTH; i++)
+            __text_append_string(text, i + 1 < DEEP_WORKLOAD_DEPTH ? "+ " : "+");
+        break;
+    case WORKLOAD_comments:
+        __append_literal(text, random, 4);
+        for (size_t i = 1; i < 32; i++) {
+            __text_append_string(text, " ");
+            __append_comment(text, random);
+            __text_append_string(text, " ");
+            __append_literal(text, random, 4);
+            __text_append_string(text, " +");
+        }
+        __text_append_string(text, " ");
+        __append_comment(text, random);
+        break;
+    case WORKLOAD_prints:
+        for (size_t i = 0; i < 64; i++) {
+            __append_literal(text, random, 6);
+            __text_append_string(text, i + 1 < 64 ? " = " : " ");
+        }
+        break;
+    case WORKLOAD_COUNT:
+        break;
+    }
+    __text_append_string(text, " =\n");
+}
+
+Text generate_workload(Workload workload, size_t size, uint64_t seed) {
+    Text text = {NULL, 0, 0};
+    uint64_t random = seed*0x9e3779b97f4a7c15ull + workload + 1;
+    while (text.len < size)
+        __generate_line(&text, workload, &random);
+    return text;
+}
+
+typedef struct {
+    char name[64];
+    double value;
+    const char* unit; // a rate, higher is better
+} Result;
+
+Result results[MAX_RESULTS];
+size_t result_count = 0;
+
+void add_result(const char* unit, double value, const char* format, const char* arg) {
+    if (result_count == MAX_RESULTS) {
+        fprintf(stderr, "Too many benchmark results\n");
+        abort();
+    }
+    Result* result = &results[result_count++];
+    snprintf(result->name, sizeof(result->name), format, arg);
+    result->value = value;
+    result->unit = unit;
+}
+
+// What every benchmark runs on
+typedef struct {
+    const char* data;
+    size_t len;
+    TokenList* tokens;
+    Program* program;
+    size_t max_depth;
+    Interpreter* interpreter;
+    Output* output;
+    number* values; // to print
+    bool reserved_stack; // for numstack/grow
+    Error error;
+} Bench;
+
+typedef void (*BenchFunction)(Bench* bench);
+
+size_t repeat = 5;
+
+double __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// The fastest of `repeat` runs, the others having been slowed down by
+// something else
+double best_time(BenchFunction function, Bench* bench) {
+    double best = 0;
+    for (size_t i = 0; i < repeat; i++) {
+        double start = __now();
+        function(bench);
+        double elapsed = __now() - start;
+        if (error_raised(&bench->error)) {
+            fprintf(stderr, "Workload failed: %s\n", bench->error.message);
+            abort();
+        }
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best > 0 ? best : 1e-9;
+}
+
+void __reset(Bench* bench) {
+    bench->tokens->first = 0;
+    bench->tokens->len = 0;
+    bench->interpreter->stack->offset = 0;
+    bench->output->len = 0;
+}
+
+void __bench_lexer(Bench* bench) {
+    __reset(bench);
+    tokenize_buffer(bench->data, bench->len, append_token_to_list, bench->tokens, &bench->error);
+}
+
+// The compiled workload without optimizations, every instruction executed
+void __bench_interpreter(Bench* bench) {
+    __reset(bench);
+    interpret_code(bench->interpreter, bench->program->code, bench->max_depth);
+}
+
+void __run_batch(Bench* bench) {
+    size_t consumed = bench->tokens->len;
+    interpret(bench->interpreter, bench->tokens);
+    clear_token_list(bench->tokens, consumed);
+}
+
+void __batch_token(Token* token, void* context) {
+    Bench* bench = context;
+    append_token(bench->tokens, token);
+    if (bench->tokens->len >= BENCH_BATCH_SIZE)
+        __run_batch(bench);
+}
+
+// What running the workload as a file does, output formatted to memory
+void __bench_end_to_end(Bench* bench) {
+    __reset(bench);
+    tokenize_buffer(bench->data, bench->len, __batch_token, bench, &bench->error);
+    __run_batch(bench);
+}
+
+void __bench_numstack(Bench* bench) {
+    numstack* stack = bench->interpreter->stack;
+    stack->offset = 0;
+    for (size_t i = 0; i < NUMSTACK_BENCH_VALUES; i++)
+        numstack_push(stack, (number) i);
+    number sum = 0;
+    for (size_t i = 0; i < NUMSTACK_BENCH_VALUES; i++)
+        sum += numstack_pop(stack);
+    // Keeps the pops from being optimized out
+    bench->output->len = sum == 1;
+}
+
+void __bench_numstack_grow(Bench* bench) {
+    numstack* stack = bench->reserved_stack
+        ? numstack_init_reserved(&SYSTEM_ALLOCATOR, NUMSTACK_GROW_VALUES)
+        : numstack_init(&SYSTEM_ALLOCATOR);
+    for (size_t i = 0; i < NUMSTACK_GROW_VALUES; i++)
+        numstack_push(stack, (number) i);
+    bench->output->len = stack->data[NUMSTACK_GROW_VALUES / 2] == 1;
+    numstack_deinit(stack);
+}
+
+void __bench_print(Bench* bench) {
+    bench->output->len = 0;
+    for (size_t i = 0; i < PRINT_BENCH_VALUES; i++)
+        output_number(bench->output, bench->values[i]);
+}
+
+const bool BENCH_OPCODE_HAS_IMMEDIATE[/*Opcode*/] = {
+#define X(op, pops, pushes, imm) \
+    [op] = imm,
+    OPCODE_LIST
+#undef X
+};
+
+size_t __count_instructions(const unsigned char* code) {
+    size_t count = 0;
+    for (const unsigned char* ip = code; *ip != OP_HALT; ip++) {
+        if (BENCH_OPCODE_HAS_IMMEDIATE[*ip])
+            ip += sizeof(number);
+        count++;
+    }
+    return count;
+}
+
+void bench_workload(Bench* bench, Workload workload, Text* text) {
+    const char* name = WORKLOAD_NAMES[workload];
+    bench->data = text->data;
+    bench->len = text->len;
+    double megabytes = text->len*1e-6;
+
+    add_result("MB/s", megabytes / best_time(__bench_lexer, bench), "lexer/%s", name);
+
+    // The tokens from the last lexer run
+    bench->max_depth = verify_token_list(bench->tokens, 0, false, &bench->error);
+    compile_token_list(bench->program, bench->tokens);
+    double instructions = __count_instructions(bench->program->code)*1e-6;
+    add_result("Mops/s", instructions / best_time(__bench_interpreter, bench),
+               "interpreter/%s", name);
+
+    add_result("MB/s", megabytes / best_time(__bench_end_to_end, bench), "end-to-end/%s", name);
+}
+
+// Values of every magnitude the workloads print, and some they do not
+void __fill_print_values(number* values, uint64_t seed) {
+    uint64_t random = seed*0x9e3779b97f4a7c15ull + WORKLOAD_COUNT + 1;
+    for (size_t i = 0; i < PRINT_BENCH_VALUES; i++) {
+        number value = (number) (__next_random(&random) % 1000000000);
+#if NUMBER_IS_FLOATING
+        static const number SCALES[] = {1, 1e-3, 1e-9, 1e3, 1e20};
+        value *= SCALES[__random_below(&random, 5)];
+#endif
+        values[i] = __random_below(&random, 2) ? value : -value;
+    }
+}
+
+// One result per line, so that --baseline can read it back with sscanf()
+void print_json(FILE* file, size_t size, uint64_t seed, const Result* baseline) {
+    fprintf(file, "{\n  \"backend\": \"%s\",\n  \"size\": %zu,\n  \"seed\": %llu,\n  \"repeat\": %zu,\n  \"results\": [\n",
+            NUMBER_BACKEND_NAME, size, (unsigned long long) seed, repeat);
+    for (size_t i = 0; i < result_count; i++) {
+        fprintf(file, "    {\"name\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"",
+                results[i].name, results[i].value, results[i].unit);
+        if (baseline && baseline[i].value > 0)
+            fprintf(file, ", \"baseline\": %.6g, \"change\": %.4f",
+                    baseline[i].value, results[i].value / baseline[i].value - 1);
+        fprintf(file, "}%s\n", i + 1 < result_count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+void print_text(FILE* file, const Result* baseline) {
+    for (size_t i = 0; i < result_count; i++) {
+        fprintf(file, "%-24s %12.2f %-*s", results[i].name, results[i].value,
+                baseline ? 10 : 0, results[i].unit);
+        if (baseline && baseline[i].value > 0)
+            fprintf(file, " %12.2f %+7.1f%%", baseline[i].value,
+                    (results[i].value / baseline[i].value - 1)*100);
+        else if (baseline)
+            fprintf(file, " %12s", "-");
+        fputc('\n', file);
+    }
+}
+
+// The values of the results in a --json output, by name. Results it does
+// not have get 0
+Result* read_baseline(const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open baseline '%s'\n", filename);
+        abort();
+    }
+    Result* baseline = calloc(MAX_RESULTS, sizeof(Result));
+    if (!baseline) {
+        fprintf(stderr, "Could not allocate baseline\n");
+        abort();
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        char name[64];
+        double value;
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"value\": %lf", name, &value) != 2)
+            continue;
+        for (size_t i = 0; i < result_count; i++)
+            if (strcmp(results[i].name, name) == 0)
+                baseline[i].value = value;
+    }
+    fclose(file);
+    return baseline;
+}
+
+const struct option LONG_OPTIONS[] = {
+    {"baseline", required_argument, NULL, 'b'},
+    {"generate", required_argument, NULL, 'g'},
+    {"help", no_argument, NULL, 'h'},
+    {"json", no_argument, NULL, 'J'},
+    {"repeat", required_argument, NULL, 'r'},
+    {"seed", required_argument, NULL, 'S'},
+    {"size", required_argument, NULL, 's'},
+    {"threshold", required_argument, NULL, 't'},
+    {"workload", required_argument, NULL, 'w'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_usage(FILE* file) {
+    fprintf(file,
+            "Usage: ccalc_bench [OPTION]...\n"
+            "  -b, --baseline=FILE  compare with the --json output in FILE, failing\n"
+            "                       if anything got slower than --threshold\n"
+            "  -g, --generate=NAME  write workload NAME to stdout instead\n"
+            "  -h, --help           show this help\n"
+            "  -J, --json           write results as JSON\n"
+            "  -r, --repeat=N       runs of each benchmark, the fastest counts (5)\n"
+            "  -S, --seed=N         seed of the workloads (1)\n"
+            "  -s, --size=MB        size of each workload (16)\n"
+            "  -t, --threshold=PCT  slowdown that counts as a regression (5)\n"
+            "  -w, --workload=NAME  only run workload NAME\n"
+            "Workloads:\n");
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+        fprintf(file, "  %-20s %s\n", WORKLOAD_NAMES[i], WORKLOAD_DESCRIPTIONS[i]);
+}
+
+Workload __parse_workload(const char* name) {
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+        if (strcmp(WORKLOAD_NAMES[i], name) == 0)
+            return i;
+    fprintf(stderr, "Unknown workload '%s'\n", name);
+    exit(EXIT_FAILURE);
+}
+
+unsigned long long __parse_count(const char* text, const char* what) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (*text < '0' || *text > '9' || *end) {
+        fprintf(stderr, "Invalid %s '%s'\n", what, text);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+int main(int argc, char** argv) {
+    size_t size = 16 << 20;
+    uint64_t seed = 1;
+    const char* baseline_path = NULL;
+    double threshold = 5;
+    bool json = false;
+    int only = -1; // workload
+    int generate = -1; // workload
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:g:hJr:S:s:t:w:", LONG_OPTIONS, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'g':
+            generate = __parse_workload(optarg);
+            break;
+        case 'h':
+            print_usage(stdout);
+            return EXIT_SUCCESS;
+        case 'J':
+            json = true;
+            break;
+        case 'r':
+            repeat = __parse_count(optarg, "repeat count");
+            if (repeat == 0)
+                repeat = 1;
+            break;
+        case 'S':
+            seed = __parse_count(optarg, "seed");
+            break;
+        case 's':
+            size = __parse_count(optarg, "size") << 20;
+            break;
+        case 't':
+            threshold = __parse_count(optarg, "threshold");
+            break;
+        case 'w':
+            only = __parse_workload(optarg);
+            break;
+        default:
+            print_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (generate >= 0) {
+        Text text = generate_workload(generate, size, seed);
+        fwrite(text.data, 1, text.len, stdout);
+        free(text.data);
+        return EXIT_SUCCESS;
+    }
+
+    Bench bench = {
+        .tokens = init_token_list(&SYSTEM_ALLOCATOR),
+        .program = init_program(&SYSTEM_ALLOCATOR),
+        .output = init_output(OUTPUT_MEMORY, NUMBER_FORMAT_SHORTEST, &SYSTEM_ALLOCATOR),
+        .values = malloc(PRINT_BENCH_VALUES*sizeof(number)),
+        .error = {CCALC_OK, ""},
+    };
+    if (!bench.values) {
+        fprintf(stderr, "Could not allocate values to print\n");
+        abort();
+    }
+    bench.interpreter = init_interpreter(bench.output, bench.output, 0, &SYSTEM_ALLOCATOR);
+    bench.interpreter->error = &bench.error;
+
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++) {
+        if (only >= 0 && (size_t) only != i)
+            continue;
+        Text text = generate_workload(i, size, seed);
+        bench_workload(&bench, i, &text);
+        free(text.data);
+        if (!json)
+            fprintf(stderr, "%s done\n", WORKLOAD_NAMES[i]);
+    }
+
+    add_result("Mops/s", 2*NUMSTACK_BENCH_VALUES*1e-6 / best_time(__bench_numstack, &bench),
+               "numstack/%s", "push-pop");
+    bench.reserved_stack = false;
+    add_result("Mops/s", NUMSTACK_GROW_VALUES*1e-6 / best_time(__bench_numstack_grow, &bench),
+               "numstack/%s", "grow-allocated");
+    bench.reserved_stack = true;
+    add_result("Mops/s", NUMSTACK_GROW_VALUES*1e-6 / best_time(__bench_numstack_grow, &bench),
+               "numstack/%s", "grow-reserved");
+    __fill_print_values(bench.values, seed);
+    bench.output->format = NUMBER_FORMAT_SHORTEST;
+    add_result("Mnumbers/s", PRINT_BENCH_VALUES*1e-6 / best_time(__bench_print, &bench),
+               "print/%s", "shortest");
+    bench.output->format = NUMBER_FORMAT_G;
+    add_result("Mnumbers/s", PRINT_BENCH_VALUES*1e-6 / best_time(__bench_print, &bench),
+               "print/%s", "g");
+
+    Result* baseline = baseline_path ? read_baseline(baseline_path) : NULL;
+    if (json)
+        print_json(stdout, size, seed, baseline);
+    else
+        print_text(stdout, baseline);
+
+    size_t regressions = 0;
+    for (size_t i = 0; baseline && i < result_count; i++)
+        if (baseline[i].value > 0 && results[i].value < baseline[i].value*(1 - threshold/100))
+            regressions++;
+    if (regressions > 0)
+        fprintf(stderr, "%zu of %zu benchmarks slower than the baseline by more than %g%%\n",
+                regressions, result_count, threshold);
+
+    bench.output->len = 0;
+    deinit_interpreter(bench.interpreter);
+    deinit_output(bench.output);
+    deinit_program(bench.program);
+    deinit_token_list(bench.tokens);
+    free(bench.values);
+    free(baseline);
+    return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
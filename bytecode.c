@@ -0,0 +1,201 @@
+#include "bytecode.h"
+#include "optimizer.h"
+#include "stats.h"
+#include "verifier.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if NUMBER_BACKEND == NUMBER_BACKEND_FIXED
+const uint32_t BYTECODE_FIXED_DIGITS = NUMBER_FIXED_DIGITS;
+#else
+const uint32_t BYTECODE_FIXED_DIGITS = 0;
+#endif
+
+static inline uint64_t __rotate_left(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Catches damaged files, not forged ones: a multiply and a rotate per 8
+// bytes, so checking costs little more than touching the pages
+uint64_t __checksum(const unsigned char* data, size_t len) {
+    const uint64_t k1 = 0x9e3779b97f4a7c15ull;
+    const uint64_t k2 = 0xc2b2ae3d27d4eb4full;
+    uint64_t hash = len*k1;
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = __rotate_left(hash ^ word*k2, 31)*k1;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, len - i);
+    hash = __rotate_left(hash ^ tail*k2, 31)*k1;
+
+    hash ^= hash >> 33;
+    hash *= k2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// The program is written to a temporary file next to `filename`, renamed
+// over it once complete, so no run ever sees a file that is only partly
+// written or lacks its header
+BytecodeWriter* init_bytecode_writer(const char* filename) {
+    const char suffix[] = ".XXXXXX";
+    size_t len = strlen(filename);
+    char* temp_filename = malloc(len + sizeof(suffix));
+    BytecodeWriter* writer = malloc(sizeof(BytecodeWriter));
+    if (!temp_filename || !writer) {
+        fprintf(stderr, "Could not allocate bytecode writer\n");
+        abort();
+    }
+    memcpy(temp_filename, filename, len);
+    memcpy(temp_filename + len, suffix, sizeof(suffix));
+
+    // mkstemp() leaves it to the owner alone
+    int fd = mkstemp(temp_filename);
+    if (fd < 0 || fchmod(fd, 0644) < 0) {
+        fprintf(stderr, "Could not create '%s': %s\n", filename, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp_filename);
+        }
+        free(temp_filename);
+        free(writer);
+        return NULL;
+    }
+
+    writer->filename = filename;
+    writer->temp_filename = temp_filename;
+    writer->file = init_output(fd, NUMBER_FORMAT_SHORTEST, &SYSTEM_ALLOCATOR);
+    writer->program = init_program(&SYSTEM_ALLOCATOR);
+    writer->depth = 0;
+    writer->code_len = 0;
+
+    // Filled in once the code is complete
+    BytecodeHeader header = {0};
+    output_write(writer->file, (const char*) &header, sizeof(header));
+    return writer;
+}
+
+// Returns false if the tokens fail verification, with nothing of them
+// written
+bool write_bytecode(BytecodeWriter* writer, TokenList* tokens, Error* error) {
+    StatsPhase phase = stats_enter(STATS_PHASE_verify);
+    verify_token_list(tokens, writer->depth, false, error);
+    if (error_raised(error)) {
+        stats_enter(phase);
+        return false;
+    }
+    stats_enter(STATS_PHASE_optimize);
+    writer->depth = optimize_token_list(tokens, writer->depth);
+    stats_enter(STATS_PHASE_compile);
+    compile_token_list(writer->program, tokens);
+    stats_enter(phase);
+
+    // Batches are joined without their OP_HALT
+    size_t len = writer->program->len - 1;
+    output_write(writer->file, (const char*) writer->program->code, len);
+    writer->code_len += len;
+    return true;
+}
+
+// The checksum is taken from the file itself, so it also covers what
+// made it to the disk
+bool __finish_bytecode(BytecodeWriter* writer, int fd) {
+    const unsigned char halt = OP_HALT;
+    output_write(writer->file, (const char*) &halt, 1);
+    writer->code_len++;
+    output_flush(writer->file);
+
+    struct stat st;
+    size_t len = sizeof(BytecodeHeader) + writer->code_len;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size != len)
+        return false;
+    void* data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        return false;
+
+    BytecodeHeader header = {
+        .magic = BYTECODE_MAGIC,
+        .version = BYTECODE_VERSION,
+        .number_backend = NUMBER_BACKEND,
+        .fixed_digits = BYTECODE_FIXED_DIGITS,
+        .reserved = 0,
+        .code_len = writer->code_len,
+        .checksum = __checksum((const unsigned char*) data + sizeof(header), writer->code_len),
+    };
+    munmap(data, len);
+    return pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+}
+
+void __release_bytecode_writer(BytecodeWriter* writer) {
+    // Nothing buffered is left to write
+    writer->file->len = 0;
+    deinit_output(writer->file);
+    deinit_program(writer->program);
+    free(writer->temp_filename);
+    free(writer);
+}
+
+bool deinit_bytecode_writer(BytecodeWriter* writer) {
+    int fd = writer->file->fd;
+    bool ok = __finish_bytecode(writer, fd);
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(writer->temp_filename, writer->filename) < 0) {
+        fprintf(stderr, "Could not rename '%s' to '%s': %s\n", writer->temp_filename,
+                writer->filename, strerror(errno));
+        ok = false;
+    }
+    else if (!ok)
+        fprintf(stderr, "Could not write '%s'\n", writer->temp_filename);
+    if (!ok)
+        unlink(writer->temp_filename);
+
+    __release_bytecode_writer(writer);
+    return ok;
+}
+
+void discard_bytecode_writer(BytecodeWriter* writer) {
+    close(writer->file->fd);
+    unlink(writer->temp_filename);
+    __release_bytecode_writer(writer);
+}
+
+bool is_bytecode(const void* data, size_t len) {
+    return len >= sizeof(BytecodeHeader)
+        && memcmp(data, BYTECODE_MAGIC, sizeof(BYTECODE_MAGIC)) == 0;
+}
+
+// The code is checked in full before any of it runs, so a damaged file
+// fails before printing anything
+bool run_bytecode(Interpreter* interpreter, const void* data, size_t len) {
+    Error* error = interpreter->error;
+    BytecodeHeader header;
+    memcpy(&header, data, sizeof(header));
+    const unsigned char* code = (const unsigned char*) data + sizeof(header);
+
+    if (header.version < BYTECODE_OLDEST_VERSION || header.version > BYTECODE_VERSION)
+        raise_error(error, CCALC_ERROR_BYTECODE, "Compiled program is of version %u, not %u to %u",
+                    header.version, BYTECODE_OLDEST_VERSION, BYTECODE_VERSION);
+    else if (header.number_backend != NUMBER_BACKEND || header.fixed_digits != BYTECODE_FIXED_DIGITS)
+        raise_error(error, CCALC_ERROR_BYTECODE, "Compiled program is not for %s numbers",
+                    NUMBER_BACKEND_NAME);
+    else if (header.code_len != len - sizeof(header)
+             || __checksum(code, header.code_len) != header.checksum)
+        raise_error(error, CCALC_ERROR_BYTECODE, "Compiled program is damaged");
+    if (error_raised(error))
+        return false;
+
+    size_t max_depth = verify_code(code, header.code_len, interpreter->stack->offset, error);
+    if (error_raised(error))
+        return false;
+    return interpret_code(interpreter, code, max_depth);
+}
@@ -0,0 +1,55 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "interpreter.h"
+#include "lexer.h"
+#include "output.h"
+#include "program.h"
+
+// A compiled program file is a BytecodeHeader followed by `code_len`
+// bytes of Program code ending in OP_HALT, immediates being numbers of
+// the build that wrote it in native byte order. It runs straight from a
+// mapping of the file, nothing is lexed or converted. Version 2 added the
+// reductions, version 1 code runs as it is
+#define BYTECODE_MAGIC "\x7f" "ccalc\n"
+#define BYTECODE_VERSION 2
+#define BYTECODE_OLDEST_VERSION 1
+
+typedef struct {
+    char magic[8]; // BYTECODE_MAGIC, null-terminated
+    uint32_t version;
+    uint32_t number_backend; // NUMBER_BACKEND
+    uint32_t fixed_digits; // NUMBER_FIXED_DIGITS of fixed point, else 0
+    uint32_t reserved; // 0
+    uint64_t code_len;
+    uint64_t checksum; // of the code
+} BytecodeHeader;
+
+// Compiles batches of tokens into a file, verified and optimized as if
+// they ran one after another on an empty stack
+typedef struct {
+    const char* filename;
+    char* temp_filename; // written until complete
+    Output* file;
+    Program* program;
+    size_t depth; // of the stack after the batches so far
+    uint64_t code_len;
+} BytecodeWriter;
+
+// NULL if the file cannot be created
+BytecodeWriter* init_bytecode_writer(const char* filename);
+bool write_bytecode(BytecodeWriter* writer, TokenList* tokens, Error* error);
+// Finishes the file and puts it in place, false if it could not be
+// written. Either way the temporary file is gone
+bool deinit_bytecode_writer(BytecodeWriter* writer);
+// Leaves whatever was at `filename` as it was
+void discard_bytecode_writer(BytecodeWriter* writer);
+
+bool is_bytecode(const void* data, size_t len);
+// Checks and runs a compiled program, false if an error was recorded
+bool run_bytecode(Interpreter* interpreter, const void* data, size_t len);
+
+#endif /* BYTECODE_H */
@@ -0,0 +1,120 @@
+#include "ccalc.h"
+#include "allocator.h"
+#include "error.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "output.h"
+#include "program.h"
+#include "stack.h"
+#include <setjmp.h>
+
+// A context owns an interpreter that records errors instead of aborting.
+// Running out of memory deep inside the lexer or the interpreter jumps
+// straight back to the entry point, every structure grows with realloc()
+// and is left as it was when that fails
+struct CCalc {
+    Allocator allocator;
+    jmp_buf out_of_memory; // set at every entry point
+    Error error;
+    TokenList* tokens;
+    Output* output;
+    Output* diagnostics;
+    Interpreter interpreter;
+};
+
+void __calc_out_of_memory(void* context, const char* what) {
+    CCalc* calc = context;
+    raise_error(&calc->error, CCALC_ERROR_OUT_OF_MEMORY, "Could not %s", what);
+    longjmp(calc->out_of_memory, 1);
+}
+
+// Releases whatever has been created so far
+void __release_calc(CCalc* calc) {
+    if (calc->interpreter.program)
+        deinit_program(calc->interpreter.program);
+    if (calc->interpreter.stack)
+        numstack_deinit(calc->interpreter.stack);
+    if (calc->diagnostics)
+        deinit_output(calc->diagnostics);
+    if (calc->output)
+        deinit_output(calc->output);
+    if (calc->tokens)
+        deinit_token_list(calc->tokens);
+    release(&calc->allocator, calc);
+}
+
+CCalc* ccalc_create(const CCalcAllocator* hooks) {
+    if (!hooks)
+        hooks = &SYSTEM_ALLOCATOR.hooks;
+    CCalc* calc = hooks->allocate(hooks->context, sizeof(CCalc));
+    if (!calc) return NULL;
+
+    calc->allocator = (Allocator) {
+        .hooks = *hooks,
+        .out_of_memory = __calc_out_of_memory,
+        .context = calc,
+    };
+    calc->error.status = CCALC_OK;
+    calc->error.message[0] = '\0';
+    calc->tokens = NULL;
+    calc->output = NULL;
+    calc->diagnostics = NULL;
+    // Not init_interpreter(), the parts are created one at a time so that
+    // none of them leaks if a later one fails
+    calc->interpreter = (Interpreter) {
+        .stack = NULL,
+        .program = NULL,
+        .output = NULL,
+        .diagnostics = NULL,
+        .error = &calc->error,
+    };
+
+    if (setjmp(calc->out_of_memory)) {
+        __release_calc(calc);
+        return NULL;
+    }
+    calc->tokens = init_token_list(&calc->allocator);
+    calc->output = init_output(OUTPUT_MEMORY, NUMBER_FORMAT_SHORTEST, &calc->allocator);
+    calc->interpreter.output = calc->output;
+    calc->diagnostics = init_output(OUTPUT_MEMORY, NUMBER_FORMAT_SHORTEST, &calc->allocator);
+    calc->interpreter.diagnostics = calc->diagnostics;
+    calc->interpreter.stack = numstack_init(&calc->allocator);
+    calc->interpreter.program = init_program(&calc->allocator);
+    return calc;
+}
+
+CCalcStatus ccalc_evaluate_buffer(CCalc* calc, const char* data, size_t len) {
+    calc->error.status = CCALC_OK;
+    calc->error.message[0] = '\0';
+    calc->tokens->first = 0;
+    calc->tokens->len = 0;
+    calc->output->len = 0;
+    calc->diagnostics->len = 0;
+    calc->interpreter.stack->offset = 0;
+
+    if (setjmp(calc->out_of_memory))
+        return calc->error.status;
+    if (tokenize_buffer(data, len, append_token_to_list, calc->tokens, &calc->error)
+        && interpret(&calc->interpreter, calc->tokens))
+        report_unused_values(&calc->interpreter);
+    return calc->error.status;
+}
+
+const char* ccalc_output(const CCalc* calc, size_t* len) {
+    *len = calc->output->len;
+    return calc->output->data;
+}
+
+const char* ccalc_diagnostics(const CCalc* calc, size_t* len) {
+    *len = calc->diagnostics->len;
+    return calc->diagnostics->data;
+}
+
+const char* ccalc_error_message(const CCalc* calc) {
+    return calc->error.message;
+}
+
+void ccalc_destroy(CCalc* calc) {
+    if (calc)
+        __release_calc(calc);
+}
@@ -0,0 +1,50 @@
+#ifndef CCALC_H
+#define CCALC_H
+
+#include <stddef.h>
+
+// Embedding API of libccalc. Contexts share no state, so every thread can
+// evaluate on a context of its own. Nothing in here aborts, failures come
+// back as a CCalcStatus with a message
+
+typedef enum {
+    CCALC_OK,
+    CCALC_ERROR_SYNTAX,
+    CCALC_ERROR_NUMBER, // a number the number type cannot hold
+    CCALC_ERROR_COLUMN, // column references only work in map mode
+    CCALC_ERROR_STACK_UNDERFLOW,
+    CCALC_ERROR_DIVISION_BY_ZERO,
+    CCALC_ERROR_OVERFLOW,
+    CCALC_ERROR_OUT_OF_MEMORY,
+    CCALC_ERROR_BYTECODE, // a compiled program that is damaged or for another build
+    CCALC_ERROR_READ, // input that could not be read to the end
+} CCalcStatus;
+
+// Memory hooks, each called with `context`. A NULL from allocate() or
+// reallocate() fails the call that needed it with CCALC_ERROR_OUT_OF_MEMORY
+typedef struct {
+    void* (*allocate)(void* context, size_t size);
+    void* (*reallocate)(void* context, void* data, size_t size);
+    void (*release)(void* context, void* data);
+    void* context;
+} CCalcAllocator;
+
+typedef struct CCalc CCalc;
+
+// With a NULL allocator memory comes from malloc(). NULL if out of memory
+CCalc* ccalc_create(const CCalcAllocator* allocator);
+// Runs the program in data[0..len) on an empty stack. Nothing is run if
+// the program does not lex or would pop from an empty stack
+CCalcStatus ccalc_evaluate_buffer(CCalc* calc, const char* data, size_t len);
+// What the last evaluation printed up to where it stopped, one number per
+// line. Not null-terminated, valid until the next evaluation
+const char* ccalc_output(const CCalc* calc, size_t* len);
+// The values a successful evaluation left on the stack, top first, as
+// lines of `Unused value on stack: N` like ccalc reports them. Not
+// null-terminated, valid until the next evaluation
+const char* ccalc_diagnostics(const CCalc* calc, size_t* len);
+// Why the last evaluation failed, empty if it did not
+const char* ccalc_error_message(const CCalc* calc);
+void ccalc_destroy(CCalc* calc);
+
+#endif /* CCALC_H */
@@ -0,0 +1,18 @@
+#include "error.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void raise_error(Error* error, CCalcStatus status, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (!error) {
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        abort();
+    }
+
+    error->status = status;
+    vsnprintf(error->message, ERROR_MESSAGE_SIZE, format, args);
+    va_end(args);
+}
@@ -0,0 +1,24 @@
+#ifndef ERROR_H
+#define ERROR_H
+
+#include <stdbool.h>
+#include "ccalc.h"
+
+#define ERROR_MESSAGE_SIZE 256
+
+// A failure recorded for the caller to handle, instead of aborting
+typedef struct {
+    CCalcStatus status;
+    char message[ERROR_MESSAGE_SIZE];
+} Error;
+
+// Records the failure in `error`. Without one to record it in, the
+// message is printed and the process aborted
+void raise_error(Error* error, CCalcStatus status, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static inline bool error_raised(const Error* error) {
+    return error && error->status != CCALC_OK;
+}
+
+#endif /* ERROR_H */
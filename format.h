@@ -0,0 +1,40 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "number.h"
+
+typedef enum {
+    NUMBER_FORMAT_SHORTEST, // fewest digits that read back as the same number
+    NUMBER_FORMAT_G, // printf("%g")
+    NUMBER_FORMAT_BINARY, // a number record of the binary format, no text
+} NumberFormat;
+
+// Enough for any number in any format, null terminator included
+#define NUMBER_TEXT_SIZE 32
+
+// Records of the binary format: a type byte followed by the value in
+// little-endian, an operator as its character, or '.', the operator of a
+// reduction and its count as a uint32. Numbers go out in the build's own
+// type, fixed point as doubles
+#define BINARY_FLOAT 'f'
+#define BINARY_DOUBLE 'd'
+#define BINARY_INT64 'i'
+
+static inline void store_le(char* data, uint64_t bits, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char) (bits >> 8*i);
+}
+
+static inline uint64_t load_le(const char* data, size_t size) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < size; i++)
+        bits |= (uint64_t) (unsigned char) data[i] << 8*i;
+    return bits;
+}
+
+// Not null-terminated in the binary format
+size_t format_number(char* buf, number num, NumberFormat format);
+
+#endif /* FORMAT_H */
@@ -1,63 +1,240 @@
 #include "interpreter.h"
+#include "optimizer.h"
+#include "output.h"
+#include "program.h"
+#include "reduce.h"
 #include "stack.h"
+#include "stats.h"
+#include "verifier.h"
 #include <stdlib.h>
+#include <string.h>
 
-numstack* stack = NULL;
+#if defined(__GNUC__) && !defined(CCALC_NO_COMPUTED_GOTO)
+#define VM_THREADED_DISPATCH
+#endif
 
-void push_number(char* data) {
-    numstack_push(stack, atof(data));
-}
+// Binary operations as (op, fused push variant, kernel)
+#define ARITHMETIC_LIST \
+    X(OP_ADD, OP_PUSH_ADD, number_add) \
+    X(OP_SUB, OP_PUSH_SUB, number_sub) \
+    X(OP_MUL, OP_PUSH_MUL, number_mul) \
+    X(OP_DIV, OP_PUSH_DIV, number_div)
+
+// Reductions as (op, kernel)
+#define REDUCTION_LIST \
+    X(OP_SUM, reduce_sum) \
+    X(OP_PRODUCT, reduce_product) \
+    X(OP_MIN, reduce_min) \
+    X(OP_MAX, reduce_max) \
+    X(OP_MEAN, reduce_mean)
 
-void add(char* data) {
-    numstack_push(stack, numstack_pop(stack) + numstack_pop(stack));
+// Output up to the failing instruction goes out first
+void arithmetic_error(Interpreter* interpreter, NumberStatus status) {
+    output_flush(interpreter->output);
+    if (status == NUMBER_DIVISION_BY_ZERO)
+        raise_error(interpreter->error, CCALC_ERROR_DIVISION_BY_ZERO, "Attempt to divide by zero");
+    else
+        raise_error(interpreter->error, CCALC_ERROR_OVERFLOW, "Arithmetic overflow");
 }
 
-void subtract(char* data) {
-    number num = numstack_pop(stack);
-    numstack_push(stack, numstack_pop(stack) - num);
+// Makes room for the depth a program reaches before any of it runs, false
+// with an error if the stack may not grow that far
+bool __reserve_depth(Interpreter* interpreter, size_t max_depth) {
+    stats_max(STATS_numstack_max_depth, max_depth);
+    if (numstack_reserve(interpreter->stack, max_depth))
+        return true;
+    raise_error(interpreter->error, CCALC_ERROR_OUT_OF_MEMORY,
+                "Stack of %zu values (%zu bytes) needed, over the limit of %zu bytes", max_depth,
+                max_depth*sizeof(number), interpreter->stack->limit*sizeof(number));
+    return false;
 }
 
-void multiply(char* data) {
-    numstack_push(stack, numstack_pop(stack) * numstack_pop(stack));
+// Errors abort, set `error` to have them recorded instead
+Interpreter* init_interpreter(Output* output, Output* diagnostics, size_t stack_limit,
+                              const Allocator* allocator) {
+    Interpreter* interpreter = allocate(allocator, sizeof(Interpreter));
+    if (!interpreter)
+        out_of_memory(allocator, "allocate interpreter struct");
+
+    interpreter->stack = stack_limit > 0 ? numstack_init_reserved(allocator, stack_limit)
+                                         : numstack_init(allocator);
+    interpreter->program = init_program(allocator);
+    interpreter->output = output;
+    interpreter->diagnostics = diagnostics;
+    interpreter->error = NULL;
+    return interpreter;
 }
 
-void divide(char* data) {
-    number num = numstack_pop(stack);
-    if (num == 0) {
-        fprintf(stderr, "Attempt to divide by zero\n");
-        abort();
+// Executes the program on the stack, which must have been checked by the
+// verifier and reserved to the depth the program reaches. With GNU C every handler jumps
+// straight to the next one through a label table, otherwise a switch is
+// used. Returns false if an arithmetic error stopped it
+//
+// The top value lives in `top` and the stack pointer in `sp`, one past
+// the top's slot, so an operation is a load and the arithmetic, with
+// nothing kept in the numstack up to date. sp[-1] is stale, written back
+// by a push and at the end. At depth 0 that is the numstack's scratch
+// slot, and `top` is whatever was in it
+bool run_program(Interpreter* interpreter, const unsigned char* code) {
+    numstack* stack = interpreter->stack;
+    Output* output = interpreter->output;
+    const unsigned char* ip = code;
+    number* sp = stack->data + stack->offset;
+    number top = sp[-1];
+    number num;
+
+#define VM_READ_NUMBER() \
+    (memcpy(&num, ip, sizeof(number)), ip += sizeof(number))
+
+#ifdef VM_THREADED_DISPATCH
+    static const void* const VM_LABELS[] = {
+#define X(op, pops, pushes, imm) \
+        [op] = &&vm_##op,
+        OPCODE_LIST
+#undef X
+    };
+#define VM_CASE(op) vm_##op:
+#define VM_NEXT() goto *VM_LABELS[*ip++]
+    VM_NEXT();
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT() goto vm_dispatch
+vm_dispatch:
+    switch (*ip++) {
+#endif
+
+    VM_CASE(OP_PUSH)
+        VM_READ_NUMBER();
+        sp[-1] = top;
+        sp++;
+        top = num;
+        VM_NEXT();
+
+    // Leaves the result on top, the operand below it having been dropped
+    // already. The kernels are inline, so floating point add, sub and mul
+    // compile down to the bare instruction and never test the status. A
+    // failing operation leaves both operands popped
+#define VM_APPLY(kernel, left, right) \
+    do { \
+        NumberStatus status = kernel(left, right, &top); \
+        if (status != NUMBER_OK) { \
+            stack->offset = sp - stack->data - 1; \
+            arithmetic_error(interpreter, status); \
+            return false; \
+        } \
+    } while (0)
+
+#define X(op, push_op, kernel) \
+    VM_CASE(op) \
+        sp--; \
+        VM_APPLY(kernel, sp[-1], top); \
+        VM_NEXT(); \
+    VM_CASE(push_op) \
+        VM_READ_NUMBER(); \
+        VM_APPLY(kernel, top, num); \
+        VM_NEXT();
+    ARITHMETIC_LIST
+#undef X
+
+    // The kernels read the values in place, so the top is written back
+    // first. A failing reduction leaves all its values popped
+#define X(op, kernel) \
+    VM_CASE(op) { \
+        VM_READ_NUMBER(); \
+        sp[-1] = top; \
+        size_t count = num != 0 ? (size_t) num : (size_t) (sp - stack->data); \
+        sp -= count; \
+        NumberStatus status = kernel(sp, count, &top); \
+        sp++; \
+        if (status != NUMBER_OK) { \
+            stack->offset = sp - stack->data - 1; \
+            arithmetic_error(interpreter, status); \
+            return false; \
+        } \
+        VM_NEXT(); \
     }
-    numstack_push(stack, numstack_pop(stack) / num);
-}
+    REDUCTION_LIST
+#undef X
+
+    VM_CASE(OP_PRINT)
+        output_number(output, top);
+        sp--;
+        top = sp[-1];
+        VM_NEXT();
+
+    VM_CASE(OP_HALT)
+        sp[-1] = top;
+        stack->offset = sp - stack->data;
+        return true;
+
+#ifndef VM_THREADED_DISPATCH
+    }
+#endif
 
-void print_number(char* data) {
-    printf("%g\n", numstack_pop(stack));
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_READ_NUMBER
+#undef VM_APPLY
 }
 
-void (*TOKEN_INTERPRET_VTABLE[/*TokenKind*/])(char*) = {
-    [TOKEN_NUMBER] = push_number,
-    [TOKEN_ADDITION] = add,
-    [TOKEN_SUBTRACTION] = subtract,
-    [TOKEN_MULTIPLICATION] = multiply,
-    [TOKEN_DIVISION] = divide,
-    [TOKEN_PRINT] = print_number,
-};
+// Returns false if an error was recorded, nothing runs if the tokens fail
+// verification or need more stack than the limit
+bool interpret(Interpreter* interpreter, TokenList* tokens) {
+    numstack* stack = interpreter->stack;
+    StatsPhase phase = stats_enter(STATS_PHASE_verify);
+    size_t max_depth = verify_token_list(tokens, stack->offset, false, interpreter->error);
+    if (error_raised(interpreter->error)) {
+        stats_enter(phase);
+        return false;
+    }
+    stats_enter(STATS_PHASE_optimize);
+    optimize_token_list(tokens, stack->offset);
+    stats_enter(STATS_PHASE_compile);
+    compile_token_list(interpreter->program, tokens);
+    stats_enter(STATS_PHASE_run);
+    if (!__reserve_depth(interpreter, max_depth)) {
+        stats_enter(phase);
+        return false;
+    }
+    bool ok = run_program(interpreter, interpreter->program->code);
+    // Batches end at every read from a pipe or terminal, so interactive
+    // output is not held back
+    output_flush(interpreter->output);
+    stats_enter(phase);
+    return ok;
+}
 
-void init_interpreter(void) {
-    stack = numstack_init();
+// Runs code that verify_code() accepted from the current stack depth,
+// taking it `max_depth` deep, without copying it anywhere
+bool interpret_code(Interpreter* interpreter, const unsigned char* code, size_t max_depth) {
+    StatsPhase phase = stats_enter(STATS_PHASE_run);
+    if (!__reserve_depth(interpreter, max_depth)) {
+        stats_enter(phase);
+        return false;
+    }
+    bool ok = run_program(interpreter, code);
+    output_flush(interpreter->output);
+    stats_enter(phase);
+    return ok;
 }
 
-void interpret(Token* token) {
-    if (!stack) {
-        fprintf(stderr, "Attempt to work on uninitialized stack\n");
-        abort();
+void report_unused_values(Interpreter* interpreter) {
+    numstack* stack = interpreter->stack;
+    Output* diagnostics = interpreter->diagnostics;
+    output_flush(interpreter->output);
+    while (stack->offset > 0) {
+        const char prefix[] = "Unused value on stack: ";
+        output_write(diagnostics, prefix, sizeof(prefix) - 1);
+        output_number(diagnostics, numstack_pop(stack));
     }
-    TOKEN_INTERPRET_VTABLE[token->kind](token->data);
+    output_flush(diagnostics);
 }
 
-void deinit_interpreter(void) {
-    while (stack->offset > 0)
-        fprintf(stderr, "Unused value on stack: %g\n",
-                numstack_pop(stack));
+void deinit_interpreter(Interpreter* interpreter) {
+    report_unused_values(interpreter);
+    numstack* stack = interpreter->stack;
+    const Allocator* allocator = stack->allocator;
     numstack_deinit(stack);
+    deinit_program(interpreter->program);
+    release(allocator, interpreter);
 }
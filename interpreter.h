@@ -1,10 +1,35 @@
 #ifndef INTERPRETER_H
 #define INTERPRETER_H
 
+#include <stdbool.h>
+#include "allocator.h"
+#include "error.h"
 #include "lexer.h"
+#include "output.h"
+#include "program.h"
+#include "stack.h"
 
-void init_interpreter(void);
-void interpret(Token* token);
-void deinit_interpreter(void);
+// Everything one run of a program touches, so that independent runs can
+// go on in parallel. The outputs belong to the caller
+typedef struct {
+    numstack* stack;
+    Program* program;
+    Output* output; // of print
+    Output* diagnostics; // of unused values
+    Error* error; // NULL to abort on errors
+} Interpreter;
+
+// The stack holds at most `stack_limit` values, in address space reserved
+// up front where supported. With a limit of 0 it grows with the allocator
+// as far as that goes
+Interpreter* init_interpreter(Output* output, Output* diagnostics, size_t stack_limit,
+                              const Allocator* allocator);
+bool interpret(Interpreter* interpreter, TokenList* tokens);
+bool interpret_code(Interpreter* interpreter, const unsigned char* code, size_t max_depth);
+// Reports the values left on the stack to `diagnostics`, top first, and
+// empties it
+void report_unused_values(Interpreter* interpreter);
+// Reports unused values before it goes
+void deinit_interpreter(Interpreter* interpreter);
 
 #endif /* INTERPRETER_H */
@@ -0,0 +1,388 @@
+#include "jit.h"
+
+#if JIT_SUPPORTED
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "map.h"
+
+// The program runs on JIT_STEP_ROWS rows at a time, every stack value a
+// vector holding one value per row. The values at the top of the stack
+// live in xmm0..xmm13, the one at depth d always in xmm(d % JIT_REGISTERS),
+// so no value ever moves between registers: pushing onto a full set
+// spills the deepest value, which frees exactly the register the new one
+// needs. xmm14 collects the rows that divided by zero, xmm15 is scratch
+#define JIT_REGISTERS 14
+#define JIT_ZERO_DIVISORS 14
+#define JIT_SCRATCH 15
+#define JIT_STEP_ROWS (16 / sizeof(number))
+
+// Packed instructions on doubles are those on floats with a 0x66 prefix
+#if NUMBER_BACKEND == NUMBER_BACKEND_FLOAT
+#define JIT_PACKED_PREFIX 0x00
+#else
+#define JIT_PACKED_PREFIX 0x66
+#endif
+
+// Bases of memory operands: the arguments fields (rdi), printed (rsi) and
+// spill (rcx), indexed by r8 being the offset of the step's rows in a
+// slot. r9 is the index of the step's first row into status (rdx)
+#define JIT_RCX 1
+#define JIT_RSI 6
+#define JIT_RDI 7
+#define JIT_RIP 5 // ModRM r/m of RIP-relative addressing with mod 0
+
+// Bytes after 0x0f of the SSE instructions used
+enum {
+    SSE_LOAD = 0x10,
+    SSE_STORE = 0x11,
+    SSE_MOVMSK = 0x50,
+    SSE_OR = 0x56,
+    SSE_XOR = 0x57,
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_SUB = 0x5c,
+    SSE_DIV = 0x5e,
+    SSE_CMP = 0xc2,
+};
+
+const unsigned char SSE_BY_TOKEN_KIND[/*TokenKind*/] = {
+    [TOKEN_ADDITION] = SSE_ADD,
+    [TOKEN_SUBTRACTION] = SSE_SUB,
+    [TOKEN_MULTIPLICATION] = SSE_MUL,
+    [TOKEN_DIVISION] = SSE_DIV,
+};
+
+// Native code of one token is at most this long, spills included
+const size_t JIT_MAX_TOKEN_SIZE = 256;
+const size_t MIN_JIT_CODE_CAPACITY = 4096;
+
+typedef void (*JitFunction)(const number* fields, number* printed, unsigned char* status,
+                            number* spill);
+
+struct Jit {
+    const Allocator* allocator;
+    // Constants first, a vector each, then the code reading them
+    // RIP-relative
+    unsigned char* code;
+    size_t len;
+    size_t cap;
+    // Of the stack at the token being translated
+    size_t depth;
+    size_t cached; // values at the top held in registers
+    // Executable copy of the code, the function at `entry`
+    void* memory;
+    size_t memory_size;
+    size_t entry;
+};
+
+void __jit_reserve(Jit* jit, size_t extra) {
+    size_t cap = jit->cap > 0 ? jit->cap : MIN_JIT_CODE_CAPACITY;
+    while (jit->len + extra > cap)
+        cap *= 2;
+    if (cap == jit->cap) return;
+
+    unsigned char* new_code = reallocate(jit->allocator, jit->code, cap);
+    if (!new_code)
+        out_of_memory(jit->allocator, "expand jit code");
+
+    jit->code = new_code;
+    jit->cap = cap;
+}
+
+static inline void __emit(Jit* jit, const void* data, size_t len) {
+    memcpy(jit->code + jit->len, data, len);
+    jit->len += len;
+}
+
+static inline void __emit_byte(Jit* jit, unsigned char byte) {
+    jit->code[jit->len++] = byte;
+}
+
+static inline void __emit_u32(Jit* jit, uint32_t value) {
+    __emit(jit, &value, sizeof(value));
+}
+
+static inline unsigned char __modrm(int mod, int reg, int rm) {
+    return mod << 6 | (reg & 7) << 3 | (rm & 7);
+}
+
+// op xmm `reg`, xmm `rm`
+void __emit_sse_register(Jit* jit, unsigned char op, int reg, int rm) {
+    if (JIT_PACKED_PREFIX)
+        __emit_byte(jit, JIT_PACKED_PREFIX);
+    if (reg >= 8 || rm >= 8)
+        __emit_byte(jit, 0x40 | (reg >= 8) << 2 | (rm >= 8));
+    __emit_byte(jit, 0x0f);
+    __emit_byte(jit, op);
+    __emit_byte(jit, __modrm(3, reg, rm));
+}
+
+// op xmm `reg`, [base + r8 + disp] if `indexed`, else [base + disp]. With
+// JIT_RIP the operand is the constant at `disp` of the code
+void __emit_sse_memory(Jit* jit, unsigned char op, int reg, int base, bool indexed, size_t disp) {
+    if (JIT_PACKED_PREFIX)
+        __emit_byte(jit, JIT_PACKED_PREFIX);
+    if (reg >= 8 || indexed)
+        __emit_byte(jit, 0x40 | (reg >= 8) << 2 | indexed << 1);
+    __emit_byte(jit, 0x0f);
+    __emit_byte(jit, op);
+    if (base == JIT_RIP) {
+        __emit_byte(jit, __modrm(0, reg, JIT_RIP));
+        disp -= jit->len + sizeof(uint32_t);
+    }
+    else if (indexed) {
+        __emit_byte(jit, __modrm(2, reg, 4)); // SIB follows
+        __emit_byte(jit, __modrm(0, 8, base)); // scale 1, index r8
+    }
+    else __emit_byte(jit, __modrm(2, reg, base));
+    __emit_u32(jit, disp);
+}
+
+static inline int __register_of(size_t index) {
+    return index % JIT_REGISTERS;
+}
+
+// Stores the deepest cached values until only `keep` remain in registers
+void __spill(Jit* jit, size_t keep) {
+    for (; jit->cached > keep; jit->cached--) {
+        size_t index = jit->depth - jit->cached;
+        __emit_sse_memory(jit, SSE_STORE, __register_of(index), JIT_RCX, false, 16*index);
+    }
+}
+
+// Loads spilled values until the top `count` are in registers
+void __fill(Jit* jit, size_t count) {
+    while (jit->cached < count) {
+        jit->cached++;
+        size_t index = jit->depth - jit->cached;
+        __emit_sse_memory(jit, SSE_LOAD, __register_of(index), JIT_RCX, false, 16*index);
+    }
+}
+
+// The register of a value about to be pushed
+int __push(Jit* jit) {
+    if (jit->cached == JIT_REGISTERS)
+        __spill(jit, JIT_REGISTERS - 1);
+    jit->cached++;
+    return __register_of(jit->depth++);
+}
+
+// Pops the top two values and pushes `left op right`
+void __emit_arithmetic(Jit* jit, unsigned char op) {
+    __fill(jit, 2);
+    int left = __register_of(jit->depth - 2);
+    int right = __register_of(jit->depth - 1);
+    // Like the lane kernel, every row is divided and the zero divisors are
+    // flagged on the side
+    if (op == SSE_DIV) {
+        __emit_sse_register(jit, SSE_XOR, JIT_SCRATCH, JIT_SCRATCH);
+        __emit_sse_register(jit, SSE_CMP, JIT_SCRATCH, right);
+        __emit_byte(jit, 0); // equal
+        __emit_sse_register(jit, SSE_OR, JIT_ZERO_DIVISORS, JIT_SCRATCH);
+    }
+    __emit_sse_register(jit, op, left, right);
+    jit->depth--;
+    jit->cached--;
+}
+
+// Where a column is at r8 of the fields, and a print at r8 of printed
+size_t __slot_offset(size_t slot) {
+    return slot*MAP_LANES*sizeof(number);
+}
+
+// Translates one token, or two where a constant or a column is the right
+// operand of the next. Returns the tokens consumed, 0 if a displacement
+// does not fit
+size_t __translate_token(Jit* jit, TokenList* tokens, size_t i, size_t* constants, size_t* prints) {
+    unsigned char kind = tokens->kinds[i];
+    number operand = tokens->operands[i];
+    unsigned char next = i + 1 < tokens->len ? tokens->kinds[i + 1] : TOKEN_PRINT;
+    bool arithmetic_next = next != TOKEN_NUMBER && next != TOKEN_COLUMN && next != TOKEN_PRINT;
+
+    switch (kind) {
+    case TOKEN_NUMBER: {
+        size_t position = 16*(*constants)++;
+        for (size_t j = 0; j < JIT_STEP_ROWS; j++)
+            memcpy(jit->code + position + j*sizeof(number), &operand, sizeof(number));
+
+        // Only a zero divisor needs checking
+        if (arithmetic_next && (next != TOKEN_DIVISION || operand != 0)) {
+            __fill(jit, 1);
+            __emit_sse_memory(jit, SSE_BY_TOKEN_KIND[next], __register_of(jit->depth - 1),
+                              JIT_RIP, false, position);
+            return 2;
+        }
+        __emit_sse_memory(jit, SSE_LOAD, __push(jit), JIT_RIP, false, position);
+        return 1;
+    }
+    case TOKEN_COLUMN: {
+        size_t offset = __slot_offset((size_t) operand - 1);
+        if (offset > INT32_MAX)
+            return 0;
+        if (arithmetic_next && next != TOKEN_DIVISION) {
+            __fill(jit, 1);
+            __emit_sse_memory(jit, SSE_BY_TOKEN_KIND[next], __register_of(jit->depth - 1),
+                              JIT_RDI, true, offset);
+            return 2;
+        }
+        __emit_sse_memory(jit, SSE_LOAD, __push(jit), JIT_RDI, true, offset);
+        return 1;
+    }
+    case TOKEN_PRINT: {
+        size_t offset = __slot_offset((*prints)++);
+        if (offset > INT32_MAX)
+            return 0;
+        __fill(jit, 1);
+        __emit_sse_memory(jit, SSE_STORE, __register_of(jit->depth - 1), JIT_RSI, true, offset);
+        jit->depth--;
+        jit->cached--;
+        return 1;
+    }
+    default:
+        __emit_arithmetic(jit, SSE_BY_TOKEN_KIND[kind]);
+        return 1;
+    }
+}
+
+// Leaves the code in jit->code: a loop over the steps of a block with the
+// program as its body
+bool __translate(Jit* jit, TokenList* tokens) {
+    size_t constants = 0;
+    bool divides = false;
+    for (size_t i = 0; i < tokens->len; i++) {
+        constants += tokens->kinds[i] == TOKEN_NUMBER;
+        divides |= tokens->kinds[i] == TOKEN_DIVISION;
+    }
+
+    // Constants are followed by the code, aligned to a cache line
+    jit->entry = (16*constants + 63) & ~(size_t) 63;
+    __jit_reserve(jit, jit->entry + JIT_MAX_TOKEN_SIZE);
+    memset(jit->code, 0, jit->entry);
+    jit->len = jit->entry;
+    jit->depth = 0;
+    jit->cached = 0;
+
+    const unsigned char loop_start[] = {
+        0x45, 0x31, 0xc0, // xor r8d, r8d
+        0x45, 0x31, 0xc9, // xor r9d, r9d
+    };
+    __emit(jit, loop_start, sizeof(loop_start));
+    size_t step = jit->len;
+    if (divides)
+        __emit_sse_register(jit, SSE_XOR, JIT_ZERO_DIVISORS, JIT_ZERO_DIVISORS);
+
+    size_t constant = 0;
+    size_t print = 0;
+    for (size_t i = 0; i < tokens->len;) {
+        __jit_reserve(jit, JIT_MAX_TOKEN_SIZE);
+        size_t consumed = __translate_token(jit, tokens, i, &constant, &print);
+        if (consumed == 0)
+            return false;
+        i += consumed;
+    }
+
+    __jit_reserve(jit, JIT_MAX_TOKEN_SIZE);
+    size_t flag_jump = 0;
+    if (divides) {
+        __emit_sse_register(jit, SSE_MOVMSK, 0, JIT_ZERO_DIVISORS); // to eax
+        const unsigned char jump_if_any[] = {
+            0x85, 0xc0, // test eax, eax
+            0x0f, 0x85, 0x00, 0x00, 0x00, 0x00, // jnz rel32 to the flagging
+        };
+        __emit(jit, jump_if_any, sizeof(jump_if_any));
+        flag_jump = jit->len;
+    }
+    size_t next_step = jit->len;
+    const unsigned char loop_end[] = {
+        0x49, 0x83, 0xc0, 16, // add r8, 16
+        0x49, 0x83, 0xc1, JIT_STEP_ROWS, // add r9, JIT_STEP_ROWS
+        0x49, 0x81, 0xf8, // cmp r8, imm32
+    };
+    __emit(jit, loop_end, sizeof(loop_end));
+    __emit_u32(jit, MAP_LANES*sizeof(number));
+    __emit_byte(jit, 0x0f); // jb rel32
+    __emit_byte(jit, 0x82);
+    __emit_u32(jit, step - (jit->len + sizeof(uint32_t)));
+    __emit_byte(jit, 0xc3); // ret
+
+    // Flags the rows whose bits are set in eax
+    if (divides) {
+        uint32_t rel = jit->len - flag_jump;
+        memcpy(jit->code + flag_jump - sizeof(rel), &rel, sizeof(rel));
+        for (size_t j = 0; j < JIT_STEP_ROWS; j++) {
+            const unsigned char flag_row[] = {
+                0xa8, 1 << j, // test al, 1 << j
+                0x74, 0x06, // jz over the or
+                0x42, 0x80, 0x4c, 0x0a, j, NUMBER_DIVISION_BY_ZERO, // or byte [rdx + r9 + j], imm8
+            };
+            __emit(jit, flag_row, sizeof(flag_row));
+        }
+        __emit_byte(jit, 0xe9); // jmp rel32
+        __emit_u32(jit, next_step - (jit->len + sizeof(uint32_t)));
+    }
+    return true;
+}
+
+// The code is written once and only ever executable after that
+bool __install(Jit* jit) {
+    size_t size = (jit->len + 4095) & ~(size_t) 4095;
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    memcpy(memory, jit->code, jit->len);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) < 0) {
+        munmap(memory, size);
+        return false;
+    }
+    jit->memory = memory;
+    jit->memory_size = size;
+    return true;
+}
+
+Jit* init_jit(TokenList* tokens, const Allocator* allocator) {
+    Jit* jit = allocate(allocator, sizeof(Jit));
+    if (!jit)
+        out_of_memory(allocator, "allocate jit struct");
+    *jit = (Jit) {.allocator = allocator, .code = NULL, .memory = NULL};
+
+    bool ok = __translate(jit, tokens) && __install(jit);
+    release(allocator, jit->code);
+    jit->code = NULL;
+    if (!ok) {
+        release(allocator, jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void jit_run_block(Jit* jit, const number* fields, number* printed, unsigned char* status,
+                   number* spill) {
+    JitFunction function = (JitFunction) ((unsigned char*) jit->memory + jit->entry);
+    function(fields, printed, status, spill);
+}
+
+void deinit_jit(Jit* jit) {
+    munmap(jit->memory, jit->memory_size);
+    release(jit->allocator, jit);
+}
+
+#else /* !JIT_SUPPORTED */
+
+Jit* init_jit(TokenList* tokens, const Allocator* allocator) {
+    (void) tokens, (void) allocator;
+    return NULL;
+}
+
+void jit_run_block(Jit* jit, const number* fields, number* printed, unsigned char* status,
+                   number* spill) {
+    (void) jit, (void) fields, (void) printed, (void) status, (void) spill;
+}
+
+void deinit_jit(Jit* jit) {
+    (void) jit;
+}
+
+#endif /* JIT_SUPPORTED */
@@ -0,0 +1,28 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "allocator.h"
+#include "lexer.h"
+#include "number.h"
+
+// Map programs are translated to native code on x86-64 with a floating
+// point number type. Elsewhere there is no JIT, init_jit() returns NULL
+// and the lane kernels of map mode run everything
+#if defined(__x86_64__) && NUMBER_IS_FLOATING && !defined(CCALC_NO_JIT)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+typedef struct Jit Jit;
+
+// Translates an optimized map program that leaves the stack empty. NULL
+// if there is no JIT or the program cannot be translated
+Jit* init_jit(TokenList* tokens, const Allocator* allocator);
+// Evaluates a block of MAP_LANES rows laid out like MapProgram's fields,
+// printed and status. `spill` has room for a vector per stack slot
+void jit_run_block(Jit* jit, const number* fields, number* printed, unsigned char* status,
+                   number* spill);
+void deinit_jit(Jit* jit);
+
+#endif /* JIT_H */
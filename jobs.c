@@ -0,0 +1,98 @@
+#include "jobs.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Jobs a thread may run ahead of the oldest unfinished one, bounding what
+// is held in memory while it waits for its turn
+const size_t JOB_WINDOW_PER_THREAD = 4;
+
+typedef struct {
+    size_t count;
+    size_t window;
+    JobHandler run_job;
+    void* context;
+    atomic_size_t next; // first job nobody has taken
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t finished; // jobs before this one are finished
+    bool* done;
+} JobPool;
+
+// Threads take the next job as soon as they are free, so a long job holds
+// up one thread while the others keep going through the rest
+void* __job_worker(void* arg) {
+    JobPool* pool = arg;
+    for (;;) {
+        size_t job = atomic_fetch_add(&pool->next, 1);
+        if (job >= pool->count) break;
+
+        pthread_mutex_lock(&pool->lock);
+        while (job >= pool->finished + pool->window)
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->run_job(job, pool->context);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done[job] = true;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Runs jobs 0..count on `threads` threads, in any order. finish_job() is
+// called on the calling thread in order, as soon as a job and every job
+// before it have run
+void run_jobs(size_t count, size_t threads, JobHandler run_job, JobHandler finish_job, void* context) {
+    if (threads > count)
+        threads = count;
+
+    JobPool pool = {
+        .count = count,
+        .window = threads*JOB_WINDOW_PER_THREAD,
+        .run_job = run_job,
+        .context = context,
+        .finished = 0,
+        .done = calloc(count ? count : 1, sizeof(bool)),
+    };
+    pthread_t* workers = malloc((threads ? threads : 1)*sizeof(pthread_t));
+    if (!pool.done || !workers) {
+        fprintf(stderr, "Could not allocate job pool\n");
+        abort();
+    }
+    atomic_init(&pool.next, 0);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    for (size_t i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, __job_worker, &pool) != 0) {
+            fprintf(stderr, "Could not start worker thread\n");
+            abort();
+        }
+    }
+
+    for (size_t job = 0; job < count; job++) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.done[job])
+            pthread_cond_wait(&pool.changed, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        finish_job(job, context);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.finished = job + 1;
+        pthread_cond_broadcast(&pool.changed);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    for (size_t i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    pthread_cond_destroy(&pool.changed);
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+    free(pool.done);
+}
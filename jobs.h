@@ -0,0 +1,11 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stddef.h>
+
+// Called with the index of a job
+typedef void (*JobHandler)(size_t job, void* context);
+
+void run_jobs(size_t count, size_t threads, JobHandler run_job, JobHandler finish_job, void* context);
+
+#endif /* JOBS_H */
@@ -1,8 +1,15 @@
 #include "lexer.h"
+#include "format.h"
+#include "jobs.h"
+#include "scan.h"
+#include "stats.h"
 #include <stdbool.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define CHAR_SINGLE_CHECK_LIST \
     X(dot, '.') \
@@ -12,7 +19,10 @@
     X(minus, '-') \
     X(star, '*') \
     X(slash, '/') \
-    X(eqsign, '=')
+    X(eqsign, '=') \
+    X(dollar, '$') \
+    X(less, '<') \
+    X(greater, '>')
 #define X(cname, cval) \
     bool __char_is_##cname(unsigned char c) { \
         return c == cval;\
@@ -25,6 +35,12 @@ bool __char_is_e_or_E(unsigned char c) {
     return c == 'e' || c == 'E';
 }
 
+// isspace() of the "C" locale, spelled out so the class table and the
+// scanners in scan.c agree regardless of the current locale
+bool __char_is_space(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
 #define CHAR_KINDS_LIST \
     X(CHAR_NUMERIC, isdigit) \
     X(CHAR_DOT, __fptr_char_is(dot)) \
@@ -34,7 +50,10 @@ bool __char_is_e_or_E(unsigned char c) {
     X(CHAR_STAR, __fptr_char_is(star)) \
     X(CHAR_SLASH, __fptr_char_is(slash)) \
     X(CHAR_EQSIGN, __fptr_char_is(eqsign)) \
-    X(CHAR_WS, isspace)
+    X(CHAR_DOLLAR, __fptr_char_is(dollar)) \
+    X(CHAR_LESS, __fptr_char_is(less)) \
+    X(CHAR_GREATER, __fptr_char_is(greater)) \
+    X(CHAR_WS, __char_is_space)
 
 typedef enum {
 #define X(ce, cf) \
@@ -52,94 +71,94 @@ CharKind detect_char_kind(unsigned char c) {
     return CHAR_OTHER;
 }
 
-const size_t MIN_STRING_CAPACITY = 32;
-
-Token* init_token(void) {
-    size_t cap = MIN_STRING_CAPACITY;
-    char* data = calloc(cap, sizeof(char));
-    if (!data) {
-        fprintf(stderr, "Could not allocate string for token\n");
-        abort();
-    };
+const char* const TOKEN_TEXT[/*TokenKind*/] = {
+    [TOKEN_NUMBER] = "number",
+    [TOKEN_ADDITION] = "+",
+    [TOKEN_SUBTRACTION] = "-",
+    [TOKEN_MULTIPLICATION] = "*",
+    [TOKEN_DIVISION] = "/",
+    [TOKEN_PRINT] = "=",
+    [TOKEN_COLUMN] = "$",
+    [TOKEN_SUM] = ".+",
+    [TOKEN_PRODUCT] = ".*",
+    [TOKEN_MIN] = ".<",
+    [TOKEN_MAX] = ".>",
+    [TOKEN_MEAN] = "./",
+};
 
-    Token* token = malloc(sizeof(Token));
-    if (!token) {
-        fprintf(stderr, "Could not allocate token struct\n");
-        abort();
-    };
+const size_t MIN_TOKEN_LIST_CAPACITY = 16;
 
-    token->kind = TOKEN_SKIP;
-    token->data = data;
-    token->cap = cap;
-    return token;
+// The arena holds `cap` operands followed by `cap` kinds
+size_t __token_list_arena_size(size_t cap) {
+    return cap*(sizeof(number) + sizeof(unsigned char));
 }
 
-void deinit_token(Token* token) {
-    free(token->data);
-    free(token);
+void __token_list_place(TokenList* token_list) {
+    token_list->operands = token_list->arena;
+    token_list->kinds = (unsigned char*) token_list->arena + token_list->cap*sizeof(number);
 }
 
-void append_char(Token* token, char c) {
-    size_t chars_len = strlen(token->data); // without \0
-
-    if (chars_len+2 > token->cap) {
-        char* new_data = realloc(token->data, token->cap*2*sizeof(char));
-        if (!new_data) {
-            fprintf(stderr, "Could not reallocate string for token\n");
-            abort();
-        }
-
-        token->data = new_data;
-        token->cap *= 2;
-    }
-
-    token->data[chars_len] = c;
-    token->data[chars_len+1] = '\0';
-}
-
-const size_t MIN_TOKEN_LIST_CAPACITY = 16;
-
-TokenList* init_token_list(void) {
+TokenList* init_token_list(const Allocator* allocator) {
     size_t cap = MIN_TOKEN_LIST_CAPACITY;
-    Token** head = calloc(cap, sizeof(Token*));
-    if (!head) {
-        fprintf(stderr, "Could not allocate data for token list\n");
-        abort();
-    }
+    void* arena = allocate(allocator, __token_list_arena_size(cap));
+    if (!arena)
+        out_of_memory(allocator, "allocate arena for token list");
 
-    TokenList* token_list = malloc(sizeof(TokenList));
+    TokenList* token_list = allocate(allocator, sizeof(TokenList));
     if (!token_list) {
-        fprintf(stderr, "Could not allocate token list struct\n");
-        abort();
+        release(allocator, arena);
+        out_of_memory(allocator, "allocate token list struct");
     }
 
-    token_list->head = head;
+    token_list->arena = arena;
+    token_list->first = 0;
     token_list->len = 0;
     token_list->cap = cap;
+    token_list->allocator = allocator;
+    __token_list_place(token_list);
 
     return token_list;
 }
 
+// Keeps counting tokens of the same input, call after consuming a batch
+void clear_token_list(TokenList* token_list, size_t consumed) {
+    token_list->first += consumed;
+    token_list->len = 0;
+}
+
 void deinit_token_list(TokenList* token_list) {
-    for (size_t i = 0; i < token_list->len; i++)
-        deinit_token(token_list->head[i]);
-    free(token_list);
+    const Allocator* allocator = token_list->allocator;
+    release(allocator, token_list->arena);
+    release(allocator, token_list);
 }
 
-void append_token(TokenList* dest, Token* token) {
-    if (dest->len == dest->cap) {
-        Token** new_token_head = realloc(dest->head, dest->cap*2*sizeof(Token*));
-        if (!new_token_head) {
-            fprintf(stderr, "Could not reallocate token array for token list struct\n");
-            abort();
-        }
+void __token_list_resize(TokenList* token_list) {
+    size_t old_cap = token_list->cap;
+    void* new_arena = reallocate(token_list->allocator, token_list->arena,
+                                 __token_list_arena_size(old_cap*2));
+    if (!new_arena)
+        out_of_memory(token_list->allocator, "expand token list arena");
+
+    token_list->arena = new_arena;
+    token_list->cap = old_cap*2;
+    // Kinds moved up together with the end of the operands
+    memmove((unsigned char*) new_arena + token_list->cap*sizeof(number),
+            (unsigned char*) new_arena + old_cap*sizeof(number),
+            token_list->len);
+    __token_list_place(token_list);
+}
 
-        dest->head = new_token_head;
-        dest->cap *= 2;
-    }
+void append_token(TokenList* dest, Token* token) {
+    if (dest->len == dest->cap)
+        __token_list_resize(dest);
 
+    dest->kinds[dest->len] = token->kind;
+    dest->operands[dest->len] = token->value;
     dest->len++;
-    dest->head[dest->len-1] = token;
+}
+
+void append_token_to_list(Token* token, void* token_list) {
+    append_token(token_list, token);
 }
 
 #define TOKENIZER_STATE_LIST \
@@ -157,6 +176,13 @@ void append_token(TokenList* dest, Token* token) {
     X(TOKENIZER_STATE_NUM_FRAC, TOKEN_NUMBER) \
     X(TOKENIZER_STATE_NUM_EXP, TOKEN_NUMBER) \
     X(TOKENIZER_STATE_NUM_E_NP, TOKEN_NUMBER) \
+    X(TOKENIZER_STATE_COL_SIGN, TOKEN_SKIP) \
+    X(TOKENIZER_STATE_COL, TOKEN_COLUMN) \
+    X(TOKENIZER_STATE_RED_SUM, TOKEN_SUM) \
+    X(TOKENIZER_STATE_RED_PROD, TOKEN_PRODUCT) \
+    X(TOKENIZER_STATE_RED_MIN, TOKEN_MIN) \
+    X(TOKENIZER_STATE_RED_MAX, TOKEN_MAX) \
+    X(TOKENIZER_STATE_RED_MEAN, TOKEN_MEAN) \
     X(TOKENIZER_STATE_ERR, TOKEN_SKIP)
 
 typedef enum {
@@ -164,6 +190,7 @@ typedef enum {
     ts,
     TOKENIZER_STATE_LIST
 #undef X
+    TOKENIZER_STATE_COUNT
 } TokenizerState;
 
 const TokenKind TOKEN_KIND_BY_TOKENIZER_STATE[/*TokenizerState*/] = {
@@ -187,6 +214,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_INIT][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_INIT][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_INIT][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_INIT][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_INIT][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_INIT][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_INIT][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_INIT][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -198,17 +228,23 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_NUM_INT][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_NUM_INT][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_NUM_INT][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_NUM_INT][CHAR_DOLLAR] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_NUM_INT][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_NUM_INT][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_NUM_INT][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_NUM_INT][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
     [TOKENIZER_STATE_NUM_DOT][CHAR_NUMERIC] = {TOKENIZER_STATE_NUM_FRAC, false},
     [TOKENIZER_STATE_NUM_DOT][CHAR_DOT] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_DOT][CHAR_E] = {TOKENIZER_STATE_ERR, true},
-    [TOKENIZER_STATE_NUM_DOT][CHAR_PLUS] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_DOT][CHAR_PLUS] = {TOKENIZER_STATE_RED_SUM, false},
     [TOKENIZER_STATE_NUM_DOT][CHAR_MINUS] = {TOKENIZER_STATE_ERR, true},
-    [TOKENIZER_STATE_NUM_DOT][CHAR_STAR] = {TOKENIZER_STATE_ERR, true},
-    [TOKENIZER_STATE_NUM_DOT][CHAR_SLASH] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_DOT][CHAR_STAR] = {TOKENIZER_STATE_RED_PROD, false},
+    [TOKENIZER_STATE_NUM_DOT][CHAR_SLASH] = {TOKENIZER_STATE_RED_MEAN, false},
     [TOKENIZER_STATE_NUM_DOT][CHAR_EQSIGN] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_DOT][CHAR_DOLLAR] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_DOT][CHAR_LESS] = {TOKENIZER_STATE_RED_MIN, false},
+    [TOKENIZER_STATE_NUM_DOT][CHAR_GREATER] = {TOKENIZER_STATE_RED_MAX, false},
     [TOKENIZER_STATE_NUM_DOT][CHAR_WS] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_DOT][CHAR_OTHER] = {TOKENIZER_STATE_ERR, true},
 
@@ -220,6 +256,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_ADD][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_ADD][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_ADD][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_ADD][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_ADD][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_ADD][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_ADD][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_ADD][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -231,6 +270,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_SUB][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_SUB][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_SUB][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_SUB][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_SUB][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_SUB][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_SUB][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_SUB][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -242,6 +284,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_MULT][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_MULT][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_MULT][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_MULT][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_MULT][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_MULT][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_MULT][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_MULT][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -253,6 +298,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_DIV][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_DIV][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_DIV][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_DIV][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_DIV][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_DIV][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_DIV][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_DIV][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -264,6 +312,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_PRT][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_PRT][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_PRT][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_PRT][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_PRT][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_PRT][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_PRT][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_PRT][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -275,6 +326,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_WS][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_WS][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_WS][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_WS][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_WS][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_WS][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_WS][CHAR_WS] = {TOKENIZER_STATE_WS, false},
     [TOKENIZER_STATE_WS][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -286,6 +340,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_COMM][CHAR_STAR] = {TOKENIZER_STATE_COMM, false},
     [TOKENIZER_STATE_COMM][CHAR_SLASH] = {TOKENIZER_STATE_COMM, false},
     [TOKENIZER_STATE_COMM][CHAR_EQSIGN] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COMM][CHAR_DOLLAR] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COMM][CHAR_LESS] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COMM][CHAR_GREATER] = {TOKENIZER_STATE_COMM, false},
     [TOKENIZER_STATE_COMM][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_COMM][CHAR_OTHER] = {TOKENIZER_STATE_COMM, false},
 
@@ -297,6 +354,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_NUM_E][CHAR_STAR] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_E][CHAR_SLASH] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_E][CHAR_EQSIGN] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_E][CHAR_DOLLAR] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_E][CHAR_LESS] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_E][CHAR_GREATER] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_E][CHAR_WS] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_E][CHAR_OTHER] = {TOKENIZER_STATE_ERR, true},
 
@@ -308,6 +368,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_NUM_FRAC][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_NUM_FRAC][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_NUM_FRAC][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_NUM_FRAC][CHAR_DOLLAR] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_NUM_FRAC][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_NUM_FRAC][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_NUM_FRAC][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_NUM_FRAC][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -319,6 +382,9 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_NUM_EXP][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
     [TOKENIZER_STATE_NUM_EXP][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
     [TOKENIZER_STATE_NUM_EXP][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_NUM_EXP][CHAR_DOLLAR] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_NUM_EXP][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_NUM_EXP][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
     [TOKENIZER_STATE_NUM_EXP][CHAR_WS] = {TOKENIZER_STATE_WS, true},
     [TOKENIZER_STATE_NUM_EXP][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 
@@ -330,67 +396,567 @@ const TokenDigestRule TOKENIZER_RULESET[/*TokenizerState*/][/*CharKind*/ CHAR_OT
     [TOKENIZER_STATE_NUM_E_NP][CHAR_STAR] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_E_NP][CHAR_SLASH] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_E_NP][CHAR_EQSIGN] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_E_NP][CHAR_DOLLAR] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_E_NP][CHAR_LESS] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_NUM_E_NP][CHAR_GREATER] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_E_NP][CHAR_WS] = {TOKENIZER_STATE_ERR, true},
     [TOKENIZER_STATE_NUM_E_NP][CHAR_OTHER] = {TOKENIZER_STATE_ERR, true},
+
+    // '$' not followed by a digit starts a comment, as it always did
+    [TOKENIZER_STATE_COL_SIGN][CHAR_NUMERIC] = {TOKENIZER_STATE_COL, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_DOT] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_E] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_PLUS] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_MINUS] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_STAR] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_SLASH] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_EQSIGN] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_DOLLAR] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_LESS] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_GREATER] = {TOKENIZER_STATE_COMM, false},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_WS] = {TOKENIZER_STATE_WS, true},
+    [TOKENIZER_STATE_COL_SIGN][CHAR_OTHER] = {TOKENIZER_STATE_COMM, false},
+
+    [TOKENIZER_STATE_COL][CHAR_NUMERIC] = {TOKENIZER_STATE_COL, false},
+    [TOKENIZER_STATE_COL][CHAR_DOT] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_COL][CHAR_E] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_COL][CHAR_PLUS] = {TOKENIZER_STATE_ADD, true},
+    [TOKENIZER_STATE_COL][CHAR_MINUS] = {TOKENIZER_STATE_SUB, true},
+    [TOKENIZER_STATE_COL][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
+    [TOKENIZER_STATE_COL][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
+    [TOKENIZER_STATE_COL][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_COL][CHAR_DOLLAR] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_COL][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_COL][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_COL][CHAR_WS] = {TOKENIZER_STATE_WS, true},
+    [TOKENIZER_STATE_COL][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
+
+    // Reductions, the count digits before the dot lexed as a number
+    [TOKENIZER_STATE_RED_SUM][CHAR_NUMERIC] = {TOKENIZER_STATE_NUM_INT, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_DOT] = {TOKENIZER_STATE_NUM_DOT, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_E] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_PLUS] = {TOKENIZER_STATE_ADD, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_MINUS] = {TOKENIZER_STATE_SUB, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_WS] = {TOKENIZER_STATE_WS, true},
+    [TOKENIZER_STATE_RED_SUM][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
+
+    [TOKENIZER_STATE_RED_PROD][CHAR_NUMERIC] = {TOKENIZER_STATE_NUM_INT, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_DOT] = {TOKENIZER_STATE_NUM_DOT, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_E] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_PLUS] = {TOKENIZER_STATE_ADD, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_MINUS] = {TOKENIZER_STATE_SUB, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_WS] = {TOKENIZER_STATE_WS, true},
+    [TOKENIZER_STATE_RED_PROD][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
+
+    [TOKENIZER_STATE_RED_MIN][CHAR_NUMERIC] = {TOKENIZER_STATE_NUM_INT, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_DOT] = {TOKENIZER_STATE_NUM_DOT, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_E] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_PLUS] = {TOKENIZER_STATE_ADD, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_MINUS] = {TOKENIZER_STATE_SUB, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_WS] = {TOKENIZER_STATE_WS, true},
+    [TOKENIZER_STATE_RED_MIN][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
+
+    [TOKENIZER_STATE_RED_MAX][CHAR_NUMERIC] = {TOKENIZER_STATE_NUM_INT, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_DOT] = {TOKENIZER_STATE_NUM_DOT, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_E] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_PLUS] = {TOKENIZER_STATE_ADD, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_MINUS] = {TOKENIZER_STATE_SUB, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_WS] = {TOKENIZER_STATE_WS, true},
+    [TOKENIZER_STATE_RED_MAX][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
+
+    [TOKENIZER_STATE_RED_MEAN][CHAR_NUMERIC] = {TOKENIZER_STATE_NUM_INT, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_DOT] = {TOKENIZER_STATE_NUM_DOT, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_E] = {TOKENIZER_STATE_ERR, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_PLUS] = {TOKENIZER_STATE_ADD, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_MINUS] = {TOKENIZER_STATE_SUB, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_STAR] = {TOKENIZER_STATE_MULT, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_SLASH] = {TOKENIZER_STATE_DIV, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_EQSIGN] = {TOKENIZER_STATE_PRT, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_DOLLAR] = {TOKENIZER_STATE_COL_SIGN, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_LESS] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_GREATER] = {TOKENIZER_STATE_COMM, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_WS] = {TOKENIZER_STATE_WS, true},
+    [TOKENIZER_STATE_RED_MEAN][CHAR_OTHER] = {TOKENIZER_STATE_COMM, true},
 };
 
+// TOKENIZER_RULESET expanded over all bytes, so digesting a char is a
+// single lookup. Entries are the new state with TRANSITION_SPLIT or'ed in.
+// Outside map programs '$' starts a comment like before columns existed,
+// the second table having COMM wherever the ruleset goes to COL_SIGN
+const unsigned char TRANSITION_SPLIT = 0x80;
+typedef unsigned char TransitionTable[TOKENIZER_STATE_COUNT][256];
+TransitionTable TOKENIZER_TRANSITIONS;
+TransitionTable TOKENIZER_TRANSITIONS_WITH_COLUMNS;
+pthread_once_t lexer_tables_once = PTHREAD_ONCE_INIT;
+
+void __build_lexer_tables(void) {
+    for (int c = 0; c < 256; c++) {
+        CharKind kind = detect_char_kind(c);
+        // TOKENIZER_RULESET has no row for the error state, it is final
+        for (TokenizerState state = 0; state < TOKENIZER_STATE_ERR; state++) {
+            TokenDigestRule rule = TOKENIZER_RULESET[state][kind];
+            unsigned char split = rule.do_split ? TRANSITION_SPLIT : 0;
+            TOKENIZER_TRANSITIONS_WITH_COLUMNS[state][c] = rule.new_state | split;
+            TOKENIZER_TRANSITIONS[state][c] = (rule.new_state == TOKENIZER_STATE_COL_SIGN
+                                               ? TOKENIZER_STATE_COMM : rule.new_state) | split;
+        }
+        TOKENIZER_TRANSITIONS_WITH_COLUMNS[TOKENIZER_STATE_ERR][c] = TOKENIZER_STATE_ERR;
+        TOKENIZER_TRANSITIONS[TOKENIZER_STATE_ERR][c] = TOKENIZER_STATE_ERR;
+    }
+    init_scanners();
+}
+
 typedef struct {
     TokenizerState current_state;
-    Token* token;
-    TokenList* output_list;
+    TokenKind token_kind;
+    size_t token_start;
+    const TransitionTable* transitions;
+    TokenHandler handle_token;
+    void* context;
+    Error* error; // NULL to abort on errors
 } Tokenizer;
 
-Tokenizer* init_tokenizer(TokenList* token_list) {
-    Tokenizer* tokenizer = malloc(sizeof(Tokenizer));
-    if (!tokenizer) {
-        fprintf(stderr, "Could not allocate tokenizer struct\n");
-        abort();
+void init_tokenizer(Tokenizer* tokenizer, bool columns, TokenHandler handle_token, void* context,
+                    Error* error) {
+    pthread_once(&lexer_tables_once, __build_lexer_tables);
+    tokenizer->transitions = columns ? &TOKENIZER_TRANSITIONS_WITH_COLUMNS : &TOKENIZER_TRANSITIONS;
+    tokenizer->current_state = TOKENIZER_STATE_INIT;
+    tokenizer->token_kind = TOKEN_SKIP;
+    tokenizer->token_start = 0;
+    tokenizer->handle_token = handle_token;
+    tokenizer->context = context;
+    tokenizer->error = error;
+}
+
+// Digits after the '$' of a column reference
+bool __try_parse_column(const char* data, size_t len, number* result) {
+    size_t index = 0;
+    for (size_t i = 1; i < len && index <= MAX_COLUMN_INDEX; i++)
+        index = index*10 + (data[i] - '0');
+    *result = (number) index;
+    return index > 0 && index <= MAX_COLUMN_INDEX;
+}
+
+number __parse_column(const char* data, size_t len, Error* error) {
+    number index;
+    if (!__try_parse_column(data, len, &index))
+        raise_error(error, CCALC_ERROR_COLUMN, "Column '%.*s' is out of range", (int) len, data);
+    return index;
+}
+
+// The count before the dot of a reduction, 0 if there is none. Lexed as
+// the start of a number, it may have a minus sign
+number __parse_reduction(const char* data, size_t len, Error* error) {
+    size_t count = 0;
+    size_t i = 0;
+    for (; data[i] >= '0' && data[i] <= '9' && count <= MAX_REDUCTION_COUNT; i++)
+        count = count*10 + (data[i] - '0');
+    if (data[i] != '.' || (i > 0 && (count == 0 || count > MAX_REDUCTION_COUNT)))
+        raise_error(error, CCALC_ERROR_SYNTAX, "Invalid reduction '%.*s'", (int) len, data);
+    return (number) count;
+}
+
+// Returns false if the token could not be converted
+bool push_token(Tokenizer* tokenizer, const char* data, size_t end) {
+    Token token = {
+        .kind = tokenizer->token_kind,
+        .data = data + tokenizer->token_start,
+        .len = end - tokenizer->token_start,
+        .value = 0,
+    };
+    if (token.kind == TOKEN_NUMBER)
+        token.value = parse_number(token.data, token.len, tokenizer->error);
+    else if (token.kind == TOKEN_COLUMN)
+        token.value = __parse_column(token.data, token.len, tokenizer->error);
+    else if (token_kind_is_reduction(token.kind))
+        token.value = __parse_reduction(token.data, token.len, tokenizer->error);
+    if (error_raised(tokenizer->error))
+        return false;
+    tokenizer->handle_token(&token, tokenizer->context);
+    return true;
+}
+
+// Skips the rest of a run of bytes that keep the tokenizer in its state,
+// these are the only self-loops in TOKENIZER_RULESET without a split
+size_t skip_run(TokenizerState state, const unsigned char* data, size_t len) {
+    switch (state) {
+    case TOKENIZER_STATE_NUM_INT:
+    case TOKENIZER_STATE_NUM_FRAC:
+    case TOKENIZER_STATE_NUM_EXP:
+    case TOKENIZER_STATE_COL:
+        return scan_digits(data, len);
+    case TOKENIZER_STATE_WS:
+        return scan_space(data, len);
+    case TOKENIZER_STATE_COMM:
+        return scan_nonspace(data, len);
+    default:
+        return 0;
     }
+}
 
-    tokenizer->current_state = TOKENIZER_STATE_INIT;
-    tokenizer->token = init_token();
-    tokenizer->output_list = token_list;
-    return tokenizer;
+// Digests data[from..len), the token in progress starts at token_start.
+// Returns false on an error
+bool digest_chars(Tokenizer* tokenizer, const char* data, size_t from, size_t len) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    const TransitionTable* transitions = tokenizer->transitions;
+    TokenizerState state = tokenizer->current_state;
+
+    for (size_t i = from; i < len; i++) {
+        i += skip_run(state, bytes + i, len - i);
+        if (i == len) break;
+
+        unsigned char transition = (*transitions)[state][bytes[i]];
+        if (transition & TRANSITION_SPLIT) {
+            if (tokenizer->token_kind != TOKEN_SKIP && !push_token(tokenizer, data, i))
+                return false;
+            tokenizer->token_start = i;
+        }
+        state = transition & ~TRANSITION_SPLIT;
+        if (state == TOKENIZER_STATE_ERR) {
+            raise_error(tokenizer->error, CCALC_ERROR_SYNTAX, "Syntax error");
+            return false;
+        }
+        tokenizer->token_kind = TOKEN_KIND_BY_TOKENIZER_STATE[state];
+    }
+
+    tokenizer->current_state = state;
+    return true;
 }
 
-void update_token_kind(Tokenizer* tokenizer) {
-    tokenizer->token->kind = TOKEN_KIND_BY_TOKENIZER_STATE[tokenizer->current_state];
+bool finish_tokenizer(Tokenizer* tokenizer, const char* data, size_t len) {
+    if (tokenizer->token_kind != TOKEN_SKIP)
+        return push_token(tokenizer, data, len);
+    return true;
 }
 
-void push_token(Tokenizer* tokenizer, bool alloc_new) {
-    append_token(tokenizer->output_list, tokenizer->token);
-    tokenizer->token = alloc_new ? init_token() : NULL;
+// Returns false if an error was recorded
+bool tokenize_buffer(const char* data, size_t len, TokenHandler handle_token, void* context,
+                     Error* error) {
+    Tokenizer tokenizer;
+    init_tokenizer(&tokenizer, false, handle_token, context, error);
+    return digest_chars(&tokenizer, data, 0, len) && finish_tokenizer(&tokenizer, data, len);
 }
 
-void digest_char(Tokenizer* tokenizer, unsigned char c) {
-    TokenDigestRule rule = TOKENIZER_RULESET[tokenizer->current_state][detect_char_kind(c)];
-    if (rule.do_split && tokenizer->token->kind != TOKEN_SKIP)
-        push_token(tokenizer, true);
-    tokenizer->current_state = rule.new_state;
-    if (tokenizer->current_state == TOKENIZER_STATE_ERR) {
-        fprintf(stderr, "Syntax error\n");
+bool tokenize_map_program(const char* data, size_t len, TokenHandler handle_token, void* context,
+                          Error* error) {
+    Tokenizer tokenizer;
+    init_tokenizer(&tokenizer, true, handle_token, context, error);
+    return digest_chars(&tokenizer, data, 0, len) && finish_tokenizer(&tokenizer, data, len);
+}
+
+const size_t STREAM_BUFFER_SIZE = 1 << 20;
+
+// Returns false if an error was recorded, reading stops there
+bool tokenize_stream(FILE* file, const char* filename, TokenHandler handle_token,
+                     ChunkHandler handle_chunk, void* context, Error* error) {
+    size_t cap = STREAM_BUFFER_SIZE;
+    char* buffer = malloc(cap);
+    if (!buffer) {
+        fprintf(stderr, "Could not allocate stream buffer\n");
         abort();
     }
-    update_token_kind(tokenizer);
-    if (tokenizer->token->kind == TOKEN_SKIP) return;
-    append_char(tokenizer->token, c);
+
+    Tokenizer tokenizer;
+    init_tokenizer(&tokenizer, false, handle_token, context, error);
+
+    // read() instead of stdio so that whatever has arrived gets digested
+    // without waiting for the buffer to fill up
+    size_t len = 0;
+    for (;;) {
+        if (len == cap) {
+            char* new_buffer = realloc(buffer, cap*2);
+            if (!new_buffer) {
+                free(buffer);
+                fprintf(stderr, "Could not expand stream buffer\n");
+                abort();
+            }
+            buffer = new_buffer;
+            cap *= 2;
+        }
+
+        StatsPhase phase = stats_enter(STATS_PHASE_read);
+        ssize_t n = read(fileno(file), buffer + len, cap - len);
+        stats_enter(phase);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            raise_error(error, CCALC_ERROR_READ, "Could not read '%s': %s", filename, strerror(errno));
+            free(buffer);
+            return false;
+        }
+        if (n == 0)
+            break;
+        stats_add(STATS_bytes_read, n);
+
+        if (!digest_chars(&tokenizer, buffer, len, len + n)) {
+            free(buffer);
+            return false;
+        }
+        len += n;
+        if (handle_chunk)
+            handle_chunk(context);
+
+        // Move the unfinished token to the front so the buffer is reused
+        size_t keep = tokenizer.token_kind != TOKEN_SKIP ? len - tokenizer.token_start : 0;
+        memmove(buffer, buffer + len - keep, keep);
+        tokenizer.token_start = 0;
+        len = keep;
+    }
+
+    bool ok = finish_tokenizer(&tokenizer, buffer, len);
+    free(buffer);
+    return ok;
 }
 
-void deinit_tokenizer(Tokenizer* tokenizer) {
-    if (tokenizer->token->kind != TOKEN_SKIP)
-        push_token(tokenizer, false);
-    free(tokenizer);
+// Binary input, records as format.h describes them. Whitespace between
+// records is skipped so that operators can be typed in. Returns the bytes
+// of the whole records, the rest waiting for more input, and stops where
+// `error` is raised. `position` is that of data[0] in the input, for
+// diagnostics
+size_t __digest_binary(const char* data, size_t len, size_t position, TokenHandler handle_token,
+                       void* context, Error* error) {
+    size_t i = 0;
+    while (i < len && !error_raised(error)) {
+        Token token = {.data = data + i, .len = 1};
+        switch (data[i]) {
+        case ' ': case '\t': case '\n': case '\r':
+            i++;
+            continue;
+        case '+': token.kind = TOKEN_ADDITION; break;
+        case '-': token.kind = TOKEN_SUBTRACTION; break;
+        case '*': token.kind = TOKEN_MULTIPLICATION; break;
+        case '/': token.kind = TOKEN_DIVISION; break;
+        case '=': token.kind = TOKEN_PRINT; break;
+        case BINARY_FLOAT:
+        case BINARY_DOUBLE:
+        case BINARY_INT64: {
+            token.len = data[i] == BINARY_FLOAT ? 1 + sizeof(float) : 1 + sizeof(uint64_t);
+            if (len - i < token.len)
+                return i;
+            uint64_t bits = load_le(data + i + 1, token.len - 1);
+            const char* reason;
+            if (data[i] == BINARY_FLOAT) {
+                uint32_t narrow = (uint32_t) bits;
+                float value;
+                memcpy(&value, &narrow, sizeof(value));
+                reason = number_from_double(value, &token.value);
+            }
+            else if (data[i] == BINARY_DOUBLE) {
+                double value;
+                memcpy(&value, &bits, sizeof(value));
+                reason = number_from_double(value, &token.value);
+            }
+            else reason = number_from_int64((int64_t) bits, &token.value);
+            if (reason) {
+                raise_error(error, CCALC_ERROR_NUMBER, "Binary number %s (byte %zu)", reason, position + i);
+                return i;
+            }
+            token.kind = TOKEN_NUMBER;
+            break;
+        }
+        case '.': {
+            token.len = 2 + sizeof(uint32_t);
+            if (len - i < token.len)
+                return i;
+            switch (data[i + 1]) {
+            case '+': token.kind = TOKEN_SUM; break;
+            case '*': token.kind = TOKEN_PRODUCT; break;
+            case '<': token.kind = TOKEN_MIN; break;
+            case '>': token.kind = TOKEN_MAX; break;
+            case '/': token.kind = TOKEN_MEAN; break;
+            default: token.kind = TOKEN_SKIP;
+            }
+            uint64_t count = load_le(data + i + 2, sizeof(uint32_t));
+            if (token.kind == TOKEN_SKIP || count > MAX_REDUCTION_COUNT) {
+                raise_error(error, CCALC_ERROR_SYNTAX, "Invalid binary reduction (byte %zu)", position + i);
+                return i;
+            }
+            token.value = (number) count;
+            break;
+        }
+        default:
+            raise_error(error, CCALC_ERROR_SYNTAX, "Invalid byte 0x%02x in binary input (byte %zu)",
+                        (unsigned char) data[i], position + i);
+            return i;
+        }
+        handle_token(&token, context);
+        i += token.len;
+    }
+    return i;
 }
 
-TokenList* tokenize(FILE* file) {
-    TokenList* token_list = init_token_list();
-    Tokenizer* tokenizer = init_tokenizer(token_list);
+// The same as tokenize_stream() for binary input. Records are short, so
+// the unfinished one always fits before the next read
+bool tokenize_binary_stream(FILE* file, const char* filename, TokenHandler handle_token,
+                            ChunkHandler handle_chunk, void* context, Error* error) {
+    char* buffer = malloc(STREAM_BUFFER_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "Could not allocate stream buffer\n");
+        abort();
+    }
 
-    int c;
-    while ((c = getc(file)) != EOF) {
-        digest_char(tokenizer, c);
+    size_t len = 0;
+    size_t position = 0;
+    for (;;) {
+        StatsPhase phase = stats_enter(STATS_PHASE_read);
+        ssize_t n = read(fileno(file), buffer + len, STREAM_BUFFER_SIZE - len);
+        stats_enter(phase);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            raise_error(error, CCALC_ERROR_READ, "Could not read '%s': %s", filename, strerror(errno));
+            free(buffer);
+            return false;
+        }
+        if (n == 0)
+            break;
+        stats_add(STATS_bytes_read, n);
+
+        len += n;
+        size_t done = __digest_binary(buffer, len, position, handle_token, context, error);
+        if (error_raised(error)) {
+            free(buffer);
+            return false;
+        }
+        if (handle_chunk)
+            handle_chunk(context);
+        memmove(buffer, buffer + done, len - done);
+        position += done;
+        len -= done;
+    }
+
+    free(buffer);
+    if (len > 0) {
+        raise_error(error, CCALC_ERROR_SYNTAX, "Truncated record at the end of binary input (byte %zu)",
+                    position);
+        return false;
     }
+    return true;
+}
 
-    deinit_tokenizer(tokenizer);
+TokenList* tokenize(FILE* file) {
+    TokenList* token_list = init_token_list(&SYSTEM_ALLOCATOR);
+    tokenize_stream(file, "-", append_token_to_list, NULL, token_list, NULL);
     return token_list;
 }
+
+// Parallel lexing of a buffer: after a whitespace byte the tokenizer is in
+// the WS state whatever came before, unless it already failed, so chunks
+// cut right after whitespace can be lexed independently. Each chunk is
+// lexed into a token list of its own and the lists are handed over in
+// order. Errors are recorded with the chunk and raised when its turn
+// comes, after all tokens before them, like the sequential lexer does.
+// No chunk is handed over after that
+
+const size_t PARALLEL_LEX_CHUNK_SIZE = 1 << 22;
+
+typedef struct {
+    const char* data;
+    size_t* bounds; // chunk i is data[bounds[i]..bounds[i + 1])
+    TokenList** tokens;
+    Error* errors;
+    TokenHandler handle_token;
+    void* context;
+    Error* error;
+} ParallelLexer;
+
+void __lex_chunk(size_t chunk, void* context) {
+    ParallelLexer* lexer = context;
+    const char* data = lexer->data + lexer->bounds[chunk];
+    size_t len = lexer->bounds[chunk + 1] - lexer->bounds[chunk];
+
+    StatsPhase phase = stats_enter(STATS_PHASE_lex);
+    TokenList* tokens = init_token_list(&SYSTEM_ALLOCATOR);
+    Error* error = &lexer->errors[chunk];
+    error->status = CCALC_OK;
+    tokenize_buffer(data, len, append_token_to_list, tokens, error);
+    lexer->tokens[chunk] = tokens;
+    stats_enter(phase);
+}
+
+void __hand_over_chunk(size_t chunk, void* context) {
+    ParallelLexer* lexer = context;
+    TokenList* tokens = lexer->tokens[chunk];
+
+    // The text of the tokens is not kept
+    Token token = {.data = NULL, .len = 0};
+    for (size_t i = 0; i < tokens->len && !error_raised(lexer->error); i++) {
+        token.kind = tokens->kinds[i];
+        token.value = tokens->operands[i];
+        lexer->handle_token(&token, lexer->context);
+    }
+    deinit_token_list(tokens);
+
+    Error* error = &lexer->errors[chunk];
+    if (error_raised(error) && !error_raised(lexer->error))
+        raise_error(lexer->error, error->status, "%s", error->message);
+}
+
+// Like tokenize_buffer() on `threads` threads, the handler being called on
+// the calling thread. Tokens come without their text
+bool tokenize_buffer_parallel(const char* data, size_t len, size_t threads,
+                              TokenHandler handle_token, void* context, Error* error) {
+    if (threads <= 1 || len < 2*PARALLEL_LEX_CHUNK_SIZE)
+        return tokenize_buffer(data, len, handle_token, context, error);
+    pthread_once(&lexer_tables_once, __build_lexer_tables);
+
+    size_t max_chunks = len / PARALLEL_LEX_CHUNK_SIZE + 1;
+    ParallelLexer lexer = {
+        .data = data,
+        .bounds = malloc((max_chunks + 1)*sizeof(size_t)),
+        .tokens = malloc(max_chunks*sizeof(TokenList*)),
+        .errors = malloc(max_chunks*sizeof(Error)),
+        .handle_token = handle_token,
+        .context = context,
+        .error = error,
+    };
+    if (!lexer.bounds || !lexer.tokens || !lexer.errors) {
+        fprintf(stderr, "Could not allocate parallel lexer\n");
+        abort();
+    }
+
+    // Cut after the first whitespace past every chunk size, a chunk
+    // without any runs on into the next
+    size_t chunks = 0;
+    lexer.bounds[0] = 0;
+    size_t cut = 0;
+    while (len - cut > PARALLEL_LEX_CHUNK_SIZE) {
+        size_t from = cut + PARALLEL_LEX_CHUNK_SIZE;
+        size_t space = from + scan_nonspace((const unsigned char*) data + from, len - from);
+        if (space >= len) break;
+        cut = space + 1;
+        lexer.bounds[++chunks] = cut;
+    }
+    lexer.bounds[++chunks] = len;
+
+    run_jobs(chunks, threads, __lex_chunk, __hand_over_chunk, &lexer);
+
+    free(lexer.errors);
+    free(lexer.tokens);
+    free(lexer.bounds);
+    return !error_raised(error);
+}
@@ -1,8 +1,12 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include "allocator.h"
+#include "error.h"
+#include "number.h"
 
 typedef enum {
     TOKEN_SKIP = -1,
@@ -11,22 +15,79 @@ typedef enum {
     TOKEN_SUBTRACTION,
     TOKEN_MULTIPLICATION,
     TOKEN_DIVISION,
-    TOKEN_PRINT
+    TOKEN_PRINT,
+    TOKEN_COLUMN,
+    TOKEN_SUM,
+    TOKEN_PRODUCT,
+    TOKEN_MIN,
+    TOKEN_MAX,
+    TOKEN_MEAN,
+    TOKEN_KIND_COUNT
 } TokenKind;
 
+// Reductions replace the top `value` values with one, the whole stack
+// when `value` is 0
+static inline bool token_kind_is_reduction(unsigned char kind) {
+    return kind >= TOKEN_SUM && kind <= TOKEN_MEAN;
+}
+
 typedef struct {
     TokenKind kind;
-    char* data;
-    size_t cap;
+    const char* data; // not null-terminated
+    size_t len;
+    number value; // of a TOKEN_NUMBER, the 1-based index of a TOKEN_COLUMN,
+                  // the count of a reduction
 } Token;
 
+// Struct of arrays: kinds[i] is a TokenKind, operands[i] is the parsed
+// value of a TOKEN_NUMBER, the column index of a TOKEN_COLUMN or the
+// count of a reduction. Both live in a single arena. `first` is the
+// position of kinds[0] in the whole input, for diagnostics
 typedef struct {
-    Token** head;
+    void* arena;
+    size_t first;
+    number* operands;
+    unsigned char* kinds;
     size_t len;
     size_t cap;
+    const Allocator* allocator;
 } TokenList;
 
-TokenList* tokenize(FILE* file);
+// Highest column a TOKEN_COLUMN may refer to
+#define MAX_COLUMN_INDEX 65536
+// Highest count of a reduction, exact in every number type
+#define MAX_REDUCTION_COUNT (1 << 24)
+
+// Symbol of a token kind in the program text
+extern const char* const TOKEN_TEXT[/*TokenKind*/];
+
+// Called for every completed token; the token is only valid during the call
+typedef void (*TokenHandler)(Token* token, void* context);
+// Called by tokenize_stream() after every chunk of input has been digested
+typedef void (*ChunkHandler)(void* context);
+
+TokenList* init_token_list(const Allocator* allocator);
+void append_token(TokenList* dest, Token* token);
+// A TokenHandler appending to the TokenList given as context
+void append_token_to_list(Token* token, void* token_list);
+void clear_token_list(TokenList* token_list, size_t consumed);
 void deinit_token_list(TokenList* token_list);
 
+// Errors are recorded in `error` and stop the lexer, with a NULL error
+// they abort. A handler raising `error` stops it as well. '$' starts a
+// comment, only map programs have columns
+TokenList* tokenize(FILE* file);
+bool tokenize_buffer(const char* data, size_t len, TokenHandler handle_token, void* context,
+                     Error* error);
+bool tokenize_map_program(const char* data, size_t len, TokenHandler handle_token, void* context,
+                          Error* error);
+// A failed read is an error too, `filename` naming the file in its message
+bool tokenize_stream(FILE* file, const char* filename, TokenHandler handle_token,
+                     ChunkHandler handle_chunk, void* context, Error* error);
+// Reads records of the binary format instead of text, see format.h
+bool tokenize_binary_stream(FILE* file, const char* filename, TokenHandler handle_token,
+                            ChunkHandler handle_chunk, void* context, Error* error);
+bool tokenize_buffer_parallel(const char* data, size_t len, size_t threads,
+                              TokenHandler handle_token, void* context, Error* error);
+
 #endif /* LEXER_H */
@@ -1,34 +1,540 @@
 #include "lexer.h"
 #include <stdlib.h>
+#include "bytecode.h"
 #include "interpreter.h"
+#include "jobs.h"
+#include "map.h"
+#include "optimizer.h"
+#include "server.h"
+#include "stats.h"
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-void process_file(char* filename) {
-    FILE* fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
-    if (!fp) {
+// Tokens are interpreted in batches, which bounds memory use while keeping
+// the interpreter loop running over a dense TokenList
+const size_t TOKEN_BATCH_SIZE = 1 << 16;
+
+const size_t MAX_JOBS = 1024;
+
+// With --dump batches are optimized and printed back instead of run
+bool dump_mode = false;
+// Threads lexing a regular file, which -j gives a single file
+size_t lex_threads = 1;
+// --stats=json, printed on exit
+bool stats_json = false;
+// With --binary standard input is records of the binary format, coming
+// from another ccalc say, while the FILEs named stay text
+bool binary_input = false;
+
+// Values an interpreter's stack may hold, reserved up front. The default
+// costs address space only, pages are committed as the stack grows
+#if NUMSTACK_RESERVE_SUPPORTED
+size_t stack_limit = ((size_t) 64 << 30) / sizeof(number);
+#else
+size_t stack_limit = 0;
+#endif
+
+// Diagnostics are for people, so binary output leaves them as text
+NumberFormat text_format(NumberFormat format) {
+    return format == NUMBER_FORMAT_BINARY ? NUMBER_FORMAT_SHORTEST : format;
+}
+
+// One stream of input and what it runs on. Files share a session unless
+// they are run as independent jobs
+typedef struct {
+    TokenList* tokens;
+    Interpreter* interpreter; // NULL with --dump or --compile
+    BytecodeWriter* compiler; // with --compile
+    size_t dump_depth;
+    Error error; // of the lexer, the interpreter or the compiler
+    bool keep_errors; // for the caller, the rest of the input being skipped
+} Session;
+
+// A failing program ends there, what it printed before the error being
+// out already, with the message and a failure exit status. A --jobs file
+// or --compile instead skips the rest and leaves the error to the caller
+void __session_failed(Session* session) {
+    if (session->keep_errors) return;
+    fprintf(stderr, "%s\n", session->error.message);
+    exit(EXIT_FAILURE);
+}
+
+void process_batch(Session* session) {
+    TokenList* tokens = session->tokens;
+    size_t consumed = tokens->len;
+    if (error_raised(&session->error)) {
+        clear_token_list(tokens, consumed);
+        return;
+    }
+    stats_count_tokens(tokens);
+    if (dump_mode) {
+        StatsPhase phase = stats_enter(STATS_PHASE_optimize);
+        session->dump_depth = optimize_token_list(tokens, session->dump_depth);
+        stats_enter(STATS_PHASE_write);
+        dump_token_list(tokens, stdout);
+        stats_enter(phase);
+    }
+    else if (session->compiler) {
+        if (!write_bytecode(session->compiler, tokens, &session->error))
+            __session_failed(session);
+    }
+    else if (!interpret(session->interpreter, tokens))
+        __session_failed(session);
+    clear_token_list(tokens, consumed);
+}
+
+void interpret_token(Token* token, void* session) {
+    TokenList* tokens = ((Session*) session)->tokens;
+    append_token(tokens, token);
+    if (tokens->len < TOKEN_BATCH_SIZE) return;
+    process_batch(session);
+}
+
+// Whatever has been read from a pipe so far runs without waiting for a
+// full batch
+void interpret_chunk(void* session) {
+    process_batch(session);
+}
+
+// Compiled programs run right from the mapping, nothing is lexed
+void run_compiled_file(char* filename, void* data, size_t len, Session* session) {
+    if (!session->interpreter) {
+        fprintf(stderr, "'%s' is a compiled program, it can only be run\n", filename);
+        return;
+    }
+    if (!run_bytecode(session->interpreter, data, len))
+        __session_failed(session);
+}
+
+void stream_file(char* filename, Session* session) {
+    Error* error = &session->error;
+    if (strcmp(filename, "-") == 0) {
+        if (binary_input)
+            tokenize_binary_stream(stdin, filename, interpret_token, interpret_chunk, session, error);
+        else tokenize_stream(stdin, filename, interpret_token, interpret_chunk, session, error);
+        return;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
         fprintf(stderr, "Could not open '%s': %s\n",
                 filename, strerror(errno));
+        if (fd >= 0)
+            close(fd);
         return;
     }
 
-    TokenList* tokens = tokenize(fp);
+    // Regular files are lexed in place, tokens point right into the mapping
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close(fd);
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            stats_add(STATS_bytes_read, st.st_size);
+            if (is_bytecode(data, st.st_size))
+                run_compiled_file(filename, data, st.st_size, session);
+            else
+                tokenize_buffer_parallel(data, st.st_size, lex_threads, interpret_token, session,
+                                         error);
+            munmap(data, st.st_size);
+            return;
+        }
+    }
+
+    FILE* fp = fdopen(fd, "r");
+    if (!fp) {
+        fprintf(stderr, "Could not open '%s': %s\n",
+                filename, strerror(errno));
+        close(fd);
+        return;
+    }
+    tokenize_stream(fp, filename, interpret_token, interpret_chunk, session, error);
     fclose(fp);
+}
+
+// Reading a mapped file is part of lexing it, as pages are only read
+// when the lexer gets to them. The tokens of a batch cut short by a
+// lexer error are not run
+void process_file(char* filename, Session* session) {
+    StatsPhase phase = stats_enter(STATS_PHASE_lex);
+    stream_file(filename, session);
+    process_batch(session);
+    stats_enter(phase);
+    if (error_raised(&session->error))
+        __session_failed(session);
+}
+
+// With --jobs every file is a job with an interpreter of its own, so
+// nothing carries over between files and unused values are reported per
+// file. Jobs collect their output in memory, written out in file order.
+// A file that fails ends with its error, as if it ran alone, and the
+// others carry on
+typedef struct {
+    char** filenames;
+    NumberFormat format;
+    Output** outputs; // print output and diagnostics of each file
+    Error* errors; // of each file
+    size_t failed;
+    Output* stdout_output;
+    Output* stderr_output;
+} FileJobs;
+
+void __run_file_job(size_t job, void* context) {
+    FileJobs* jobs = context;
+    Output* output = init_output(OUTPUT_MEMORY, jobs->format, &SYSTEM_ALLOCATOR);
+    Output* diagnostics = init_output(OUTPUT_MEMORY, text_format(jobs->format), &SYSTEM_ALLOCATOR);
+    Session session = {
+        .tokens = init_token_list(&SYSTEM_ALLOCATOR),
+        .interpreter = init_interpreter(output, diagnostics, stack_limit, &SYSTEM_ALLOCATOR),
+        .keep_errors = true,
+    };
+    session.interpreter->error = &session.error;
+
+    process_file(jobs->filenames[job], &session);
+    // Values left by a failed program are not reported, like when it ends
+    // the run on its own
+    if (error_raised(&session.error))
+        session.interpreter->stack->offset = 0;
+    jobs->errors[job] = session.error;
+    deinit_interpreter(session.interpreter);
+    deinit_token_list(session.tokens);
+    jobs->outputs[2*job] = output;
+    jobs->outputs[2*job + 1] = diagnostics;
+}
+
+void __finish_file_job(size_t job, void* context) {
+    FileJobs* jobs = context;
+    Output* output = jobs->outputs[2*job];
+    Output* diagnostics = jobs->outputs[2*job + 1];
 
-    for (size_t i = 0; i < tokens->len; i++)
-        interpret(tokens->head[i]);
+    output_write(jobs->stdout_output, output->data, output->len);
+    output_flush(jobs->stdout_output);
+    output_write(jobs->stderr_output, diagnostics->data, diagnostics->len);
+    Error* error = &jobs->errors[job];
+    if (error_raised(error)) {
+        output_write(jobs->stderr_output, error->message, strlen(error->message));
+        output_write(jobs->stderr_output, "\n", 1);
+        jobs->failed++;
+    }
+    output_flush(jobs->stderr_output);
+
+    output->len = diagnostics->len = 0;
+    deinit_output(output);
+    deinit_output(diagnostics);
+}
+
+// Returns false if any of the files failed
+bool process_files_in_parallel(int filec, char** filenames, size_t threads, NumberFormat format) {
+    FileJobs jobs = {
+        .filenames = filenames,
+        .format = format,
+        .outputs = malloc(2*filec*sizeof(Output*)),
+        .errors = malloc(filec*sizeof(Error)),
+        .failed = 0,
+        .stdout_output = init_output(STDOUT_FILENO, format, &SYSTEM_ALLOCATOR),
+        .stderr_output = init_output(STDERR_FILENO, text_format(format), &SYSTEM_ALLOCATOR),
+    };
+    if (!jobs.outputs || !jobs.errors) {
+        fprintf(stderr, "Could not allocate job outputs\n");
+        abort();
+    }
+
+    run_jobs(filec, threads, __run_file_job, __finish_file_job, &jobs);
+
+    deinit_output(jobs.stderr_output);
+    deinit_output(jobs.stdout_output);
+    free(jobs.errors);
+    free(jobs.outputs);
+    return jobs.failed == 0;
+}
+
+// With --map the program comes from the command line and runs once per
+// row of the files
+int map_files(const char* text, MapInput input, size_t columns, NumberFormat format, bool jit,
+              int filec, char** filenames) {
+    Error error = {CCALC_OK, ""};
+    MapProgram* map = init_map_program(text, input, columns, format, jit && !dump_mode, &error);
+    if (!map) {
+        fprintf(stderr, "%s\n", error.message);
+        return EXIT_FAILURE;
+    }
+    if (dump_mode) {
+        dump_token_list(map->tokens, stdout);
+        deinit_map_program(map);
+        return EXIT_SUCCESS;
+    }
+
+    size_t failed = 0;
+    if (filec == 0)
+        failed += map_file(map, "-");
+    for (int i = 0; i < filec; i++)
+        failed += map_file(map, filenames[i]);
+
+    deinit_map_program(map);
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// With --compile the files are verified, optimized and compiled into one
+// program, which runs as if they ran one after another
+int compile_files(const char* path, int filec, char** filenames) {
+    Session session = {
+        .tokens = init_token_list(&SYSTEM_ALLOCATOR),
+        .compiler = init_bytecode_writer(path),
+        .keep_errors = true,
+    };
+    if (!session.compiler)
+        return EXIT_FAILURE;
+
+    if (filec == 0)
+        process_file("-", &session);
+    for (int i = 0; i < filec && !error_raised(&session.error); i++)
+        process_file(filenames[i], &session);
+
+    deinit_token_list(session.tokens);
+    // An error leaves any earlier program at `path` in place
+    if (error_raised(&session.error)) {
+        fprintf(stderr, "%s\n", session.error.message);
+        discard_bytecode_writer(session.compiler);
+        return EXIT_FAILURE;
+    }
+    return deinit_bytecode_writer(session.compiler) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void __print_stats(void) {
+    print_stats(stderr, stats_json);
+}
 
-    deinit_token_list(tokens);
+const struct option LONG_OPTIONS[] = {
+    {"binary", no_argument, NULL, 'b'},
+    {"compile", required_argument, NULL, 'C'},
+    {"columns", required_argument, NULL, 'c'},
+    {"dump", no_argument, NULL, 'd'},
+    {"format", required_argument, NULL, 'f'},
+    {"help", no_argument, NULL, 'h'},
+    {"jit", no_argument, NULL, 'J'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"map", required_argument, NULL, 'm'},
+    {"remote", required_argument, NULL, 'r'},
+    {"serve", required_argument, NULL, 's'},
+    {"stack-limit", required_argument, NULL, 'L'},
+    {"stats", optional_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0},
+};
+
+void print_usage(FILE* file) {
+    fprintf(file,
+            "Usage: ccalc [OPTION]... [FILE]...\n"
+            "  -b, --binary         standard input is binary records, or with --map\n"
+            "                       every FILE is rows of native binary numbers\n"
+            "  -C, --compile=FILE   write the program to FILE compiled, to be run\n"
+            "                       like any other FILE\n"
+            "  -c, --columns=N      fields per map input row\n"
+            "  -d, --dump           print the optimized program instead of running it\n"
+            "  -f, --format=FORMAT  print numbers as `shortest` round-trip digits\n"
+            "                       (default), like printf `g` or as `binary` records\n"
+            "  -h, --help           show this help\n"
+            "  -J, --jit            run the --map PROGRAM as native code where\n"
+            "                       supported\n"
+            "  -j, --jobs=N         run the FILEs independently on N threads, 0 for\n"
+            "                       one per CPU; a single FILE is lexed on N threads\n"
+            "  -L, --stack-limit=SIZE\n"
+            "                       fail programs needing more than SIZE bytes of\n"
+            "                       stack, with a K, M or G suffix (default 64G);\n"
+            "                       every value takes %zu bytes\n"
+            "  -m, --map=PROGRAM    run PROGRAM on every row of the FILEs, $N being\n"
+            "                       the Nth field of the row\n"
+            "  -r, --remote=SOCKET  have the daemon on SOCKET run every FILE\n"
+            "  -s, --serve=SOCKET   run as a daemon evaluating requests on SOCKET\n"
+            "  -S, --stats[=FORMAT] report time per phase and counters to stderr on\n"
+            "                       exit, as `text` (default) or `json`\n",
+            sizeof(number));
 }
 
 int main(int argc, char** argv) {
-    init_interpreter();
+    NumberFormat format = NUMBER_FORMAT_SHORTEST;
+    const char* map_text = NULL;
+    size_t map_columns = 0;
+    size_t jobs = 0; // threads, 0 for one file after another
+    const char* remote_socket = NULL;
+    const char* serve_socket = NULL;
+    const char* compile_path = NULL;
+    bool jit = false;
+    bool show_stats = false;
+    bool limit_stack = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "bC:c:df:hJj:L:m:r:s:S::", LONG_OPTIONS, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            binary_input = true;
+            break;
+        case 'C':
+            compile_path = optarg;
+            break;
+        case 'c': {
+            char* end;
+            unsigned long long columns = strtoull(optarg, &end, 10);
+            if (*optarg < '0' || *optarg > '9' || *end || columns > MAX_COLUMN_INDEX) {
+                fprintf(stderr, "Invalid number of columns '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            map_columns = columns;
+            break;
+        }
+        case 'd':
+            dump_mode = true;
+            break;
+        case 'f':
+            if (strcmp(optarg, "shortest") == 0)
+                format = NUMBER_FORMAT_SHORTEST;
+            else if (strcmp(optarg, "g") == 0)
+                format = NUMBER_FORMAT_G;
+            else if (strcmp(optarg, "binary") == 0)
+                format = NUMBER_FORMAT_BINARY;
+            else {
+                fprintf(stderr, "Unknown number format '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            print_usage(stdout);
+            return EXIT_SUCCESS;
+        case 'J':
+            jit = true;
+            break;
+        case 'j': {
+            char* end;
+            unsigned long long threads = strtoull(optarg, &end, 10);
+            if (*optarg < '0' || *optarg > '9' || *end || threads > MAX_JOBS) {
+                fprintf(stderr, "Invalid number of jobs '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            jobs = threads > 0 ? threads : (size_t) sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        }
+        case 'L': {
+            char* end;
+            unsigned long long size = strtoull(optarg, &end, 10);
+            int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+            if (shift > 0)
+                end++;
+            if (*optarg < '0' || *optarg > '9' || *end || size > (SIZE_MAX >> shift)
+                || (size << shift) < sizeof(number)) {
+                fprintf(stderr, "Invalid stack limit '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            stack_limit = (size << shift) / sizeof(number);
+            limit_stack = true;
+            break;
+        }
+        case 'm':
+            map_text = optarg;
+            break;
+        case 'r':
+            remote_socket = optarg;
+            break;
+        case 's':
+            serve_socket = optarg;
+            break;
+        case 'S':
+            show_stats = true;
+            if (!optarg || strcmp(optarg, "text") == 0)
+                stats_json = false;
+            else if (strcmp(optarg, "json") == 0)
+                stats_json = true;
+            else {
+                fprintf(stderr, "Unknown stats format '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            print_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
 
-    if (argc < 2) {
-        process_file("-");
+    if (jit && !map_text) {
+        fprintf(stderr, "--jit only applies to --map\n");
+        return EXIT_FAILURE;
+    }
+    if (jobs > 0 && (map_text || dump_mode)) {
+        fprintf(stderr, "--jobs cannot be combined with --map or --dump\n");
+        return EXIT_FAILURE;
     }
-    else for (int i = 1; i < argc; i++)
-        process_file(argv[i]);
 
-    deinit_interpreter();
+    if ((remote_socket || serve_socket) && (map_text || dump_mode || jobs > 0)) {
+        fprintf(stderr, "--remote and --serve cannot be combined with --map, --dump or --jobs\n");
+        return EXIT_FAILURE;
+    }
+    if (compile_path && (map_text || dump_mode || jobs > 0 || remote_socket || serve_socket)) {
+        fprintf(stderr, "--compile cannot be combined with --map, --dump, --jobs, --remote or --serve\n");
+        return EXIT_FAILURE;
+    }
+    if (show_stats && (map_text || remote_socket || serve_socket)) {
+        fprintf(stderr, "--stats cannot be combined with --map, --remote or --serve\n");
+        return EXIT_FAILURE;
+    }
+    if ((binary_input || format == NUMBER_FORMAT_BINARY) && (remote_socket || serve_socket)) {
+        fprintf(stderr, "--binary and --format=binary cannot be combined with --remote or --serve\n");
+        return EXIT_FAILURE;
+    }
+    if (limit_stack && (map_text || remote_socket || serve_socket)) {
+        fprintf(stderr, "--stack-limit cannot be combined with --map, --remote or --serve\n");
+        return EXIT_FAILURE;
+    }
+    if (show_stats && !STATS_SUPPORTED) {
+        fprintf(stderr, "--stats is not supported by this build\n");
+        return EXIT_FAILURE;
+    }
+    if (show_stats) {
+        enable_stats();
+        atexit(__print_stats);
+    }
+
+    if (compile_path)
+        return compile_files(compile_path, argc - optind, argv + optind);
+    if (serve_socket)
+        return serve(serve_socket);
+    if (remote_socket)
+        return call_server(remote_socket, argc - optind, argv + optind);
+
+    if (map_text)
+        return map_files(map_text, binary_input ? MAP_INPUT_BINARY : MAP_INPUT_TEXT, map_columns, format, jit, argc - optind, argv + optind);
+
+    if (jobs > 0 && argc - optind > 1) {
+        bool ok = process_files_in_parallel(argc - optind, argv + optind, jobs, format);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (jobs > 0)
+        lex_threads = jobs;
+
+    Output* output = NULL;
+    Output* diagnostics = NULL;
+    Session session = {.tokens = init_token_list(&SYSTEM_ALLOCATOR)};
+    if (!dump_mode) {
+        output = init_output(STDOUT_FILENO, format, &SYSTEM_ALLOCATOR);
+        diagnostics = init_output(STDERR_FILENO, text_format(format), &SYSTEM_ALLOCATOR);
+        session.interpreter = init_interpreter(output, diagnostics, stack_limit, &SYSTEM_ALLOCATOR);
+        session.interpreter->error = &session.error;
+    }
+
+    if (optind >= argc) {
+        process_file("-", &session);
+    }
+    else for (int i = optind; i < argc; i++)
+        process_file(argv[i], &session);
+
+    deinit_token_list(session.tokens);
+    if (!dump_mode) {
+        deinit_interpreter(session.interpreter);
+        deinit_output(diagnostics);
+        deinit_output(output);
+    }
 }
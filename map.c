@@ -0,0 +1,492 @@
+#include "map.h"
+#include "optimizer.h"
+#include "verifier.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Row failures besides the NumberStatus bits of the arithmetic
+const unsigned char ROW_MISSING_FIELD = 1 << 6;
+const unsigned char ROW_BAD_FIELD = 1 << 7;
+
+void* __map_alloc(size_t count, size_t size, const char* what) {
+    void* data = calloc(count ? count : 1, size);
+    if (!data) {
+        fprintf(stderr, "Could not allocate %s\n", what);
+        abort();
+    }
+    return data;
+}
+
+// Checks the program and works out the columns, false with `error` raised
+// if it cannot run on every row
+bool __check_map_program(MapProgram* map, const char* text, MapInput input, size_t* columns,
+                         size_t* depth, Error* error) {
+    if (!tokenize_map_program(text, strlen(text), append_token_to_list, map->tokens, error))
+        return false;
+
+    // Every row starts on an empty stack and must leave it empty
+    *depth = verify_token_list(map->tokens, 0, true, error);
+    if (error_raised(error)) return false;
+    size_t unused = optimize_token_list(map->tokens, 0);
+    if (unused > 0) {
+        raise_error(error, CCALC_ERROR_SYNTAX, "Map program leaves %zu unused value%s on stack",
+                    unused, unused == 1 ? "" : "s");
+        return false;
+    }
+
+    // Reductions of constants are folded by now, there are no lane kernels
+    // for the others
+    size_t highest = 0;
+    for (size_t i = 0; i < map->tokens->len; i++) {
+        if (token_kind_is_reduction(map->tokens->kinds[i])) {
+            raise_error(error, CCALC_ERROR_SYNTAX,
+                        "Map program reduction '%s' is not supported in map mode",
+                        TOKEN_TEXT[map->tokens->kinds[i]]);
+            return false;
+        }
+        if (map->tokens->kinds[i] == TOKEN_PRINT)
+            map->prints++;
+        if (map->tokens->kinds[i] == TOKEN_COLUMN && (size_t) map->tokens->operands[i] > highest)
+            highest = map->tokens->operands[i];
+    }
+    // Rows would print nothing, not even their line
+    if (map->prints == 0) {
+        raise_error(error, CCALC_ERROR_SYNTAX, "Map program prints nothing");
+        return false;
+    }
+    if (*columns < highest) {
+        if (*columns > 0) {
+            raise_error(error, CCALC_ERROR_COLUMN, "Map program refers to column %zu of %zu",
+                        highest, *columns);
+            return false;
+        }
+        *columns = highest;
+    }
+    if (input == MAP_INPUT_BINARY && *columns == 0) {
+        raise_error(error, CCALC_ERROR_COLUMN, "Binary map input needs the number of columns");
+        return false;
+    }
+    return true;
+}
+
+MapProgram* init_map_program(const char* text, MapInput input, size_t columns, NumberFormat format,
+                             bool jit, Error* error) {
+    MapProgram* map = __map_alloc(1, sizeof(MapProgram), "map program struct");
+    map->tokens = init_token_list(&SYSTEM_ALLOCATOR);
+    size_t depth;
+    if (!__check_map_program(map, text, input, &columns, &depth, error)) {
+        deinit_token_list(map->tokens);
+        free(map);
+        return NULL;
+    }
+
+    map->input = input;
+    map->columns = columns;
+    map->used = __map_alloc(columns, sizeof(bool), "map columns");
+    for (size_t i = 0; i < map->tokens->len; i++)
+        if (map->tokens->kinds[i] == TOKEN_COLUMN)
+            map->used[(size_t) map->tokens->operands[i] - 1] = true;
+
+    map->lanes = numstack_init(&SYSTEM_ALLOCATOR);
+    numstack_reserve(map->lanes, depth*MAP_LANES);
+    memset(map->lanes->data, 0, depth*MAP_LANES*sizeof(number));
+    map->fields = __map_alloc(columns*MAP_LANES, sizeof(number), "map fields");
+    map->printed = __map_alloc(map->prints*MAP_LANES, sizeof(number), "map prints");
+    map->status = __map_alloc(MAP_LANES, sizeof(unsigned char), "map row status");
+    map->bad_column = __map_alloc(MAP_LANES, sizeof(size_t), "map row columns");
+    map->output = init_output(STDOUT_FILENO, format, &SYSTEM_ALLOCATOR);
+    map->jit = jit ? init_jit(map->tokens, &SYSTEM_ALLOCATOR) : NULL;
+    return map;
+}
+
+void deinit_map_program(MapProgram* map) {
+    if (map->jit)
+        deinit_jit(map->jit);
+    deinit_output(map->output);
+    free(map->bad_column);
+    free(map->status);
+    free(map->printed);
+    free(map->fields);
+    numstack_deinit(map->lanes);
+    free(map->used);
+    deinit_token_list(map->tokens);
+    free(map);
+}
+
+// Kernels over a whole block, left[i] = left[i] op right[i]. They are plain
+// loops with a fixed trip count that the compiler turns into SIMD code, and
+// where the loader can pick by CPU they are built for AVX2 as well. Lanes
+// past the rows of a short block compute garbage that is never printed
+#if defined(__x86_64__) && defined(__GLIBC__) && !defined(CCALC_NO_TARGET_CLONES)
+#define LANE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_KERNEL
+#endif
+
+// A kernel out of the scalar one in number.h
+#define LANE_KERNEL_OF(name) \
+    LANE_KERNEL \
+    void __lanes_##name(number* restrict left, const number* restrict right, \
+                        unsigned char* restrict status) { \
+        for (size_t i = 0; i < MAP_LANES; i++) { \
+            number result = 0; \
+            status[i] |= number_##name(left[i], right[i], &result); \
+            left[i] = result; \
+        } \
+    }
+
+#if NUMBER_IS_FLOATING
+
+LANE_KERNEL_OF(add)
+LANE_KERNEL_OF(sub)
+LANE_KERNEL_OF(mul)
+
+// Every lane is divided and zero divisors are flagged on the side, which
+// keeps the loop free of branches
+LANE_KERNEL
+void __lanes_div(number* restrict left, const number* restrict right,
+                 unsigned char* restrict status) {
+    for (size_t i = 0; i < MAP_LANES; i++) {
+        status[i] |= (right[i] == 0) * NUMBER_DIVISION_BY_ZERO;
+        left[i] = left[i] / right[i];
+    }
+}
+
+#else
+
+// Integer add and sub wrap around and flag the lanes that overflowed,
+// which vectorizes where the overflow builtins do not
+LANE_KERNEL
+void __lanes_add(number* restrict left, const number* restrict right,
+                 unsigned char* restrict status) {
+    for (size_t i = 0; i < MAP_LANES; i++) {
+        number result = (number) ((uint64_t) left[i] + (uint64_t) right[i]);
+        // Both operands have the sign the result lacks
+        status[i] |= (((left[i] ^ result) & (right[i] ^ result)) < 0) * NUMBER_OVERFLOW;
+        left[i] = result;
+    }
+}
+
+LANE_KERNEL
+void __lanes_sub(number* restrict left, const number* restrict right,
+                 unsigned char* restrict status) {
+    for (size_t i = 0; i < MAP_LANES; i++) {
+        number result = (number) ((uint64_t) left[i] - (uint64_t) right[i]);
+        // Operands of different signs, result without the sign of the left
+        status[i] |= (((left[i] ^ right[i]) & (left[i] ^ result)) < 0) * NUMBER_OVERFLOW;
+        left[i] = result;
+    }
+}
+
+LANE_KERNEL_OF(mul)
+LANE_KERNEL_OF(div)
+
+#endif
+
+// Evaluates the program over a block of rows, the fields of which have
+// been read into map->fields
+void __run_block(MapProgram* map) {
+    number* lanes = map->lanes->data;
+    // The stack slots only hold the values the registers cannot
+    if (map->jit) {
+        jit_run_block(map->jit, map->fields, map->printed, map->status, lanes);
+        return;
+    }
+
+    unsigned char* kinds = map->tokens->kinds;
+    number* operands = map->tokens->operands;
+    size_t top = 0; // slots in use
+    size_t prints = 0;
+
+    for (size_t i = 0; i < map->tokens->len; i++) {
+        number* slot = lanes + top*MAP_LANES;
+        switch (kinds[i]) {
+        case TOKEN_NUMBER:
+            for (size_t j = 0; j < MAP_LANES; j++)
+                slot[j] = operands[i];
+            top++;
+            break;
+        case TOKEN_COLUMN:
+            memcpy(slot, map->fields + ((size_t) operands[i] - 1)*MAP_LANES,
+                   MAP_LANES*sizeof(number));
+            top++;
+            break;
+        case TOKEN_ADDITION:
+            __lanes_add(slot - 2*MAP_LANES, slot - MAP_LANES, map->status);
+            top--;
+            break;
+        case TOKEN_SUBTRACTION:
+            __lanes_sub(slot - 2*MAP_LANES, slot - MAP_LANES, map->status);
+            top--;
+            break;
+        case TOKEN_MULTIPLICATION:
+            __lanes_mul(slot - 2*MAP_LANES, slot - MAP_LANES, map->status);
+            top--;
+            break;
+        case TOKEN_DIVISION:
+            __lanes_div(slot - 2*MAP_LANES, slot - MAP_LANES, map->status);
+            top--;
+            break;
+        case TOKEN_PRINT:
+            memcpy(map->printed + prints*MAP_LANES, slot - MAP_LANES,
+                   MAP_LANES*sizeof(number));
+            prints++;
+            top--;
+            break;
+        }
+    }
+}
+
+void __report_row(MapProgram* map, const char* filename, size_t row, size_t lane) {
+    unsigned char status = map->status[lane];
+    fprintf(stderr, "%s: row %zu: ", filename, row);
+    if (status & ROW_MISSING_FIELD)
+        fprintf(stderr, "Column %zu is missing\n", map->bad_column[lane]);
+    else if (status & ROW_BAD_FIELD)
+        fprintf(stderr, "Column %zu is not a valid number\n", map->bad_column[lane]);
+    else if (status & NUMBER_DIVISION_BY_ZERO)
+        fprintf(stderr, "Attempt to divide by zero\n");
+    else
+        fprintf(stderr, "Arithmetic overflow\n");
+}
+
+// Runs the first `rows` lanes of a block and prints them, a line per row
+// with the printed values separated by spaces. Failed rows get an empty
+// line, so output lines keep matching input rows. Returns the failures
+size_t __finish_block(MapProgram* map, const char* filename, size_t first_row, size_t rows) {
+    if (rows == 0) return 0;
+    __run_block(map);
+
+    size_t failed = 0;
+    for (size_t j = 0; j < rows; j++) {
+        if (map->status[j]) {
+            output_flush(map->output);
+            __report_row(map, filename, first_row + j, j);
+            output_write(map->output, "\n", 1);
+            failed++;
+            continue;
+        }
+        for (size_t k = 0; k < map->prints; k++)
+            output_field(map->output, map->printed[k*MAP_LANES + j],
+                         k + 1 < map->prints ? ' ' : '\n');
+    }
+    memset(map->status, 0, MAP_LANES);
+    return failed;
+}
+
+// Fields use the number syntax of the program text
+bool __is_number_text(const char* p, size_t len) {
+    const char* end = p + len;
+    p += p < end && *p == '-';
+
+    const char* digits = p;
+    while (p < end && *p >= '0' && *p <= '9') p++;
+    bool integer_part = p > digits;
+    if (p < end && *p == '.') {
+        digits = ++p;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+        if (p == digits) return false;
+    }
+    else if (!integer_part) return false;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        p += p < end && *p == '-';
+        digits = p;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+        if (p == digits) return false;
+    }
+    return p == end;
+}
+
+bool __is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Reads the fields of a text row into `lane`. A line with a comma is split
+// on commas, trimming blanks around fields, otherwise on runs of blanks
+void __read_text_row(MapProgram* map, size_t lane, const char* line, size_t len) {
+    const char* p = line;
+    const char* end = line + len;
+    bool commas = memchr(line, ',', len) != NULL;
+
+    size_t column = 0;
+    for (; column < map->columns; column++) {
+        while (p < end && __is_blank(*p)) p++;
+        if (p == end && !commas) break;
+
+        const char* field = p;
+        while (p < end && *p != ',' && (commas || !__is_blank(*p))) p++;
+        const char* field_end = p;
+        while (field_end > field && __is_blank(field_end[-1])) field_end--;
+
+        if (map->used[column]) {
+            if (!__is_number_text(field, field_end - field)
+                || !try_parse_number(field, field_end - field,
+                                     &map->fields[column*MAP_LANES + lane])) {
+                map->status[lane] |= ROW_BAD_FIELD;
+                map->bad_column[lane] = column + 1;
+                return;
+            }
+        }
+
+        if (p == end) {
+            column++;
+            break;
+        }
+        p += commas; // past the comma
+    }
+
+    for (; column < map->columns; column++) {
+        if (map->used[column]) {
+            map->status[lane] |= ROW_MISSING_FIELD;
+            map->bad_column[lane] = column + 1;
+            return;
+        }
+    }
+}
+
+const size_t MAP_BUFFER_SIZE = 1 << 20;
+
+// read() that retries on interrupts. An error is reported, counted as a
+// failure and ends the input
+size_t __read_some(int fd, const char* filename, char* data, size_t len, size_t* failed) {
+    for (;;) {
+        ssize_t n = read(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "Could not read '%s': %s\n", filename, strerror(errno));
+            (*failed)++;
+            return 0;
+        }
+        return n;
+    }
+}
+
+// Rows from pipes and terminals are run as soon as they are read, instead
+// of waiting for a block to fill up, so a co-process gets its answer to a
+// row without sending any more
+size_t __map_text(MapProgram* map, int fd, const char* filename, bool stream) {
+    size_t cap = MAP_BUFFER_SIZE;
+    char* buffer = __map_alloc(cap, 1, "map input buffer");
+    size_t len = 0;
+    size_t lane = 0;
+    size_t row = 1; // of lane 0
+    size_t failed = 0;
+
+    for (;;) {
+        if (len == cap) {
+            char* new_buffer = realloc(buffer, cap*2);
+            if (!new_buffer) {
+                free(buffer);
+                fprintf(stderr, "Could not expand map input buffer\n");
+                abort();
+            }
+            buffer = new_buffer;
+            cap *= 2;
+        }
+
+        size_t n = __read_some(fd, filename, buffer + len, cap - len, &failed);
+        bool eof = n == 0;
+        len += n;
+
+        // Complete lines, and at the end whatever is left
+        size_t start = 0;
+        for (;;) {
+            char* newline = memchr(buffer + start, '\n', len - start);
+            size_t line_end = newline ? (size_t) (newline - buffer) : len;
+            if (!newline && (!eof || start == len)) break;
+
+            __read_text_row(map, lane, buffer + start, line_end - start);
+            if (++lane == MAP_LANES) {
+                failed += __finish_block(map, filename, row, lane);
+                row += lane;
+                lane = 0;
+            }
+            start = newline ? line_end + 1 : len;
+        }
+
+        memmove(buffer, buffer + start, len - start);
+        len -= start;
+        if (eof) break;
+        if (stream) {
+            failed += __finish_block(map, filename, row, lane);
+            row += lane;
+            lane = 0;
+            output_flush(map->output);
+        }
+    }
+
+    failed += __finish_block(map, filename, row, lane);
+    free(buffer);
+    return failed;
+}
+
+size_t __map_binary(MapProgram* map, int fd, const char* filename, bool stream) {
+    size_t row_size = map->columns*sizeof(number);
+    size_t cap = row_size*MAP_LANES;
+    number* rows = __map_alloc(map->columns*MAP_LANES, sizeof(number), "map input buffer");
+    size_t len = 0;
+    size_t row = 1;
+    size_t failed = 0;
+
+    for (;;) {
+        size_t n = __read_some(fd, filename, (char*) rows + len, cap - len, &failed);
+        bool eof = n == 0;
+        len += n;
+        // A full block, or from a stream whatever whole rows have arrived
+        if (len < cap && !eof && !stream) continue;
+
+        size_t lanes = len / row_size;
+        if (eof && len % row_size != 0) {
+            fprintf(stderr, "%s: row %zu: Row is truncated\n", filename, row + lanes);
+            failed++;
+        }
+
+        // Rows to columns
+        for (size_t column = 0; column < map->columns; column++)
+            if (map->used[column])
+                for (size_t j = 0; j < lanes; j++)
+                    map->fields[column*MAP_LANES + j] = rows[j*map->columns + column];
+
+        failed += __finish_block(map, filename, row, lanes);
+        row += lanes;
+        if (eof) break;
+        if (stream)
+            output_flush(map->output);
+
+        // The start of a row that is still being read
+        len -= lanes*row_size;
+        memmove(rows, (char*) rows + lanes*row_size, len);
+    }
+
+    free(rows);
+    return failed;
+}
+
+// Evaluates the program over every row of the file, "-" being stdin.
+// Returns the number of rows that failed
+size_t map_file(MapProgram* map, const char* filename) {
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    bool stream = fstat(fd, &st) < 0 || !S_ISREG(st.st_mode);
+    size_t failed = map->input == MAP_INPUT_BINARY
+        ? __map_binary(map, fd, filename, stream)
+        : __map_text(map, fd, filename, stream);
+    output_flush(map->output);
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return failed;
+}
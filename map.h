@@ -0,0 +1,45 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "error.h"
+#include "format.h"
+#include "jit.h"
+#include "lexer.h"
+#include "output.h"
+#include "stack.h"
+
+// Rows evaluated together: every stack slot holds this many lanes
+#define MAP_LANES 1024
+
+typedef enum {
+    MAP_INPUT_TEXT, // a row per line, fields split by commas or whitespace
+    MAP_INPUT_BINARY, // rows of `columns` native numbers back to back
+} MapInput;
+
+// A program evaluated once per input row, $N being the row's Nth field.
+// Slots are MAP_LANES values, one per row of the block being evaluated
+typedef struct {
+    TokenList* tokens;
+    MapInput input;
+    size_t columns; // fields read per row
+    bool* used; // columns referenced by the program
+    size_t prints;
+    numstack* lanes; // the stack, a slot per value
+    number* fields; // a slot per column
+    number* printed; // a slot per print
+    unsigned char* status; // of each row, 0 if it is fine
+    size_t* bad_column; // of each row with a missing or bad field
+    Output* output;
+    Jit* jit; // native code of the program, NULL to run the lane kernels
+} MapProgram;
+
+// With `jit` the program runs as native code where there is a JIT. NULL
+// with `error` raised if the program cannot run on rows
+MapProgram* init_map_program(const char* text, MapInput input, size_t columns, NumberFormat format,
+                             bool jit, Error* error);
+size_t map_file(MapProgram* map, const char* filename);
+void deinit_map_program(MapProgram* map);
+
+#endif /* MAP_H */
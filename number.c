@@ -0,0 +1,312 @@
+#include "number.h"
+#include "stats.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Decimal numbers of the lexer grammar are converted as mantissa * 10^exp10.
+// For floating point backends, when the mantissa fits 19 digits the result
+// is computed directly, rounding once (Clinger's fast path); anything else
+// goes through strtof()/strtod() on a normalized copy. Integer backends
+// scale the decimal exactly and reject what does not fit
+
+typedef struct {
+    bool negative;
+    uint64_t mantissa;
+    int64_t exp10;
+    bool truncated; // mantissa lost non-zero digits
+} DecimalNumber;
+
+const int MAX_MANTISSA_DIGITS = 19;
+const int64_t MAX_EXPONENT = 1000000000;
+
+DecimalNumber __scan_decimal(const char* data, size_t len) {
+    DecimalNumber dec = {false, 0, 0, false};
+    const char* p = data;
+    const char* end = data + len;
+    int digits = 0;
+
+    if (p < end && *p == '-') {
+        dec.negative = true;
+        p++;
+    }
+
+    bool fraction = false;
+    for (; p < end; p++) {
+        if (*p == '.') {
+            fraction = true;
+            continue;
+        }
+        if (*p == 'e' || *p == 'E') break;
+
+        unsigned digit = *p - '0';
+        if (dec.mantissa == 0 && digit == 0) {
+            // Leading zeros only shift the point
+            dec.exp10 -= fraction;
+        }
+        else if (digits < MAX_MANTISSA_DIGITS) {
+            dec.mantissa = dec.mantissa*10 + digit;
+            digits++;
+            dec.exp10 -= fraction;
+        }
+        else {
+            dec.truncated |= digit != 0;
+            dec.exp10 += !fraction;
+        }
+    }
+
+    if (p < end) {
+        p++;
+        bool negative_exp = p < end && *p == '-';
+        p += negative_exp;
+        int64_t exp = 0;
+        for (; p < end; p++)
+            if (exp < MAX_EXPONENT)
+                exp = exp*10 + (*p - '0');
+        dec.exp10 += negative_exp ? -exp : exp;
+    }
+
+    return dec;
+}
+
+#if NUMBER_IS_FLOATING
+
+const float FLOAT_POWERS_OF_10[] = {
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f,
+};
+
+const double DOUBLE_POWERS_OF_10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+    1e21, 1e22,
+};
+
+#if NUMBER_BACKEND == NUMBER_BACKEND_FLOAT
+
+// Returns false if the value cannot be rounded exactly without strtof()
+bool __fast_decimal_to_number(DecimalNumber dec, number* result) {
+    if (dec.truncated) return false;
+    if (dec.mantissa == 0) {
+        *result = 0;
+        return true;
+    }
+
+    // Both operands exact, one rounding in float
+    if (dec.mantissa <= (1ull << 24) && dec.exp10 >= -10 && dec.exp10 <= 10) {
+        float m = dec.mantissa;
+        *result = dec.exp10 < 0
+            ? m / FLOAT_POWERS_OF_10[-dec.exp10]
+            : m * FLOAT_POWERS_OF_10[dec.exp10];
+        return true;
+    }
+
+    // Rounded once to double, then to float. The second rounding is only
+    // wrong if the double landed exactly halfway between two floats
+    if (dec.mantissa <= (1ull << 53) && dec.exp10 >= -22 && dec.exp10 <= 22) {
+        double m = dec.mantissa;
+        double d = dec.exp10 < 0
+            ? m / DOUBLE_POWERS_OF_10[-dec.exp10]
+            : m * DOUBLE_POWERS_OF_10[dec.exp10];
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        const uint64_t float_tail_mask = (1ull << 29) - 1;
+        if ((bits & float_tail_mask) == 1ull << 28) return false;
+        *result = (float) d;
+        return true;
+    }
+
+    return false;
+}
+
+#else
+
+// Returns false if the value cannot be rounded exactly without strtod()
+bool __fast_decimal_to_number(DecimalNumber dec, number* result) {
+    if (dec.truncated) return false;
+    if (dec.mantissa > (1ull << 53) || dec.exp10 < -22 || dec.exp10 > 22)
+        return false;
+
+    double m = dec.mantissa;
+    *result = dec.exp10 < 0
+        ? m / DOUBLE_POWERS_OF_10[-dec.exp10]
+        : m * DOUBLE_POWERS_OF_10[dec.exp10];
+    return true;
+}
+
+#endif
+
+// A decimal rounds to a double like its first 767 significant digits do,
+// followed by a non-zero digit if any of the rest is one
+#define MAX_SIGNIFICANT_DIGITS 800
+const size_t NUMBER_BUFFER_SIZE = MAX_SIGNIFICANT_DIGITS + 32;
+
+// Digits without the point and a plain exponent parse the same in any locale
+number __slow_decimal_to_number(const char* data, size_t len) {
+    char str[NUMBER_BUFFER_SIZE];
+    size_t out = 0;
+    size_t digits = 0;
+    int64_t shift = 0;
+    bool fraction = false;
+    bool sticky = false;
+    const char* p = data;
+    const char* end = data + len;
+    if (p < end && *p == '-')
+        str[out++] = *p++;
+    for (; p < end && *p != 'e' && *p != 'E'; p++) {
+        if (*p == '.') {
+            fraction = true;
+            continue;
+        }
+        if (digits == 0 && *p == '0') {
+            shift -= fraction;
+        }
+        else if (digits < MAX_SIGNIFICANT_DIGITS) {
+            str[out++] = *p;
+            digits++;
+            shift -= fraction;
+        }
+        else {
+            sticky |= *p != '0';
+            shift += !fraction;
+        }
+    }
+    if (sticky) {
+        str[out++] = '1';
+        shift--;
+    }
+    if (digits == 0)
+        str[out++] = '0';
+
+    int64_t exp = 0;
+    if (p < end) {
+        p++;
+        bool negative_exp = p < end && *p == '-';
+        p += negative_exp;
+        for (; p < end; p++)
+            if (exp < MAX_EXPONENT)
+                exp = exp*10 + (*p - '0');
+        if (negative_exp) exp = -exp;
+    }
+    snprintf(str + out, NUMBER_BUFFER_SIZE - out, "e%lld", (long long) (exp + shift));
+
+#if NUMBER_BACKEND == NUMBER_BACKEND_FLOAT
+    number num = strtof(str, NULL);
+#else
+    number num = strtod(str, NULL);
+#endif
+    return num;
+}
+
+number parse_number(const char* data, size_t len, Error* error) {
+    (void) error;
+    DecimalNumber dec = __scan_decimal(data, len);
+    number num;
+    if (!__fast_decimal_to_number(dec, &num)) {
+        stats_add(STATS_slow_numbers, 1);
+        return __slow_decimal_to_number(data, len);
+    }
+    return dec.negative ? -num : num;
+}
+
+bool try_parse_number(const char* data, size_t len, number* result) {
+    *result = parse_number(data, len, NULL);
+    return true;
+}
+
+const char* number_from_double(double value, number* result) {
+    *result = (number) value;
+    return NULL;
+}
+
+const char* number_from_int64(int64_t value, number* result) {
+    *result = (number) value;
+    return NULL;
+}
+
+#else /* integers, scaled by NUMBER_SCALE */
+
+const int NUMBER_SCALE_DIGITS = NUMBER_BACKEND == NUMBER_BACKEND_FIXED ? NUMBER_FIXED_DIGITS : 0;
+
+// Fixed point rounds digits past its precision half to even, int64
+// refuses them. Returns the reason a number is refused, or NULL
+const char* __parse_scaled(const char* data, size_t len, number* result) {
+    DecimalNumber dec = __scan_decimal(data, len);
+    *result = 0;
+    if (dec.mantissa == 0) return NULL;
+
+    unsigned __int128 scaled = dec.mantissa;
+    int64_t exp10 = dec.exp10 + NUMBER_SCALE_DIGITS;
+
+    for (; exp10 > 0; exp10--) {
+        scaled *= 10;
+        if (scaled > (unsigned __int128) INT64_MAX + 1)
+            return "is out of range";
+    }
+
+    // Divide one digit at a time, remembering what was cut off
+    bool sticky = dec.truncated;
+    unsigned last_digit = 0;
+    for (; exp10 < 0 && scaled > 0; exp10++) {
+        sticky |= last_digit != 0;
+        last_digit = scaled % 10;
+        scaled /= 10;
+    }
+    if (exp10 < 0) {
+        // Ran out of digits, the first one cut off was a zero
+        sticky |= last_digit != 0;
+        last_digit = 0;
+    }
+
+    if (last_digit != 0 || sticky) {
+        if (NUMBER_BACKEND == NUMBER_BACKEND_INT64)
+            return "is not an integer";
+        if (last_digit > 5 || (last_digit == 5 && (sticky || scaled % 2 == 1)))
+            scaled++;
+    }
+
+    if (scaled > (unsigned __int128) INT64_MAX + dec.negative)
+        return "is out of range";
+    *result = dec.negative ? (number) -scaled : (number) scaled;
+    return NULL;
+}
+
+number parse_number(const char* data, size_t len, Error* error) {
+    number num;
+    const char* reason = __parse_scaled(data, len, &num);
+    if (reason)
+        raise_error(error, CCALC_ERROR_NUMBER, "Number '%.*s' %s", (int) len, data, reason);
+    return num;
+}
+
+bool try_parse_number(const char* data, size_t len, number* result) {
+    return __parse_scaled(data, len, result) == NULL;
+}
+
+const char* number_from_double(double value, number* result) {
+    double scaled = value*NUMBER_SCALE;
+    // 2^63 and its negation are exact as doubles, NaN fails as well
+    if (!(scaled >= -9223372036854775808.0 && scaled < 9223372036854775808.0))
+        return value - value != 0 ? "is not finite" : "is out of range";
+
+    // Both exact, rounded half to even like digits past the precision
+    int64_t integer = (int64_t) scaled;
+    double rest = scaled - integer;
+    if (rest != 0 && NUMBER_BACKEND == NUMBER_BACKEND_INT64)
+        return "is not an integer";
+    if (rest > 0.5 || (rest == 0.5 && integer % 2 != 0))
+        integer++;
+    else if (rest < -0.5 || (rest == -0.5 && integer % 2 != 0))
+        integer--;
+    *result = integer;
+    return NULL;
+}
+
+const char* number_from_int64(int64_t value, number* result) {
+    if (__builtin_mul_overflow(value, NUMBER_SCALE, result))
+        return "is out of range";
+    return NULL;
+}
+
+#endif /* NUMBER_IS_FLOATING */
@@ -1,6 +1,134 @@
 #ifndef NUMBER_H
 #define NUMBER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "error.h"
+
+// The number type is picked at build time with -DNUMBER_BACKEND=<one of
+// these> (CCALC_NUMBER_BACKEND in CMake). The interpreter, stack and
+// optimizer are written once against `number` and the inline kernels
+// below, so every backend gets its own fully specialized build
+#define NUMBER_BACKEND_FLOAT 0
+#define NUMBER_BACKEND_DOUBLE 1
+#define NUMBER_BACKEND_INT64 2
+#define NUMBER_BACKEND_FIXED 3
+
+#ifndef NUMBER_BACKEND
+#define NUMBER_BACKEND NUMBER_BACKEND_FLOAT
+#endif
+
+// Fixed-point numbers are int64 counts of 10^-NUMBER_FIXED_DIGITS
+#ifndef NUMBER_FIXED_DIGITS
+#define NUMBER_FIXED_DIGITS 6
+#endif
+
+#if NUMBER_BACKEND == NUMBER_BACKEND_FLOAT
 typedef float number;
+#define NUMBER_BACKEND_NAME "float"
+#define NUMBER_IS_FLOATING 1
+#elif NUMBER_BACKEND == NUMBER_BACKEND_DOUBLE
+typedef double number;
+#define NUMBER_BACKEND_NAME "double"
+#define NUMBER_IS_FLOATING 1
+#elif NUMBER_BACKEND == NUMBER_BACKEND_INT64
+typedef int64_t number;
+#define NUMBER_BACKEND_NAME "int64"
+#define NUMBER_IS_FLOATING 0
+#define NUMBER_SCALE 1
+#elif NUMBER_BACKEND == NUMBER_BACKEND_FIXED
+typedef int64_t number;
+#define NUMBER_BACKEND_NAME "fixed"
+#define NUMBER_IS_FLOATING 0
+#define NUMBER_SCALE NUMBER_FIXED_SCALE
+#else
+#error "Unknown NUMBER_BACKEND"
+#endif
+
+#define NUMBER_FIXED_SCALE ((int64_t) __NUMBER_POW10(NUMBER_FIXED_DIGITS))
+#define __NUMBER_POW10(n) __NUMBER_POW10_(n)
+#define __NUMBER_POW10_(n) 1e##n
+
+typedef enum {
+    NUMBER_OK,
+    NUMBER_OVERFLOW,
+    NUMBER_DIVISION_BY_ZERO,
+} NumberStatus;
+
+// Arithmetic kernels: the result is only written on NUMBER_OK. Floating
+// point never overflows into an error, it goes to infinity like before
+#if NUMBER_IS_FLOATING
+
+static inline NumberStatus number_add(number left, number right, number* result) {
+    *result = left + right;
+    return NUMBER_OK;
+}
+
+static inline NumberStatus number_sub(number left, number right, number* result) {
+    *result = left - right;
+    return NUMBER_OK;
+}
+
+static inline NumberStatus number_mul(number left, number right, number* result) {
+    *result = left * right;
+    return NUMBER_OK;
+}
+
+static inline NumberStatus number_div(number left, number right, number* result) {
+    if (right == 0) return NUMBER_DIVISION_BY_ZERO;
+    *result = left / right;
+    return NUMBER_OK;
+}
+
+#else /* integers, scaled by NUMBER_SCALE */
+
+static inline NumberStatus number_add(number left, number right, number* result) {
+    return __builtin_add_overflow(left, right, result) ? NUMBER_OVERFLOW : NUMBER_OK;
+}
+
+static inline NumberStatus number_sub(number left, number right, number* result) {
+    return __builtin_sub_overflow(left, right, result) ? NUMBER_OVERFLOW : NUMBER_OK;
+}
+
+static inline NumberStatus __number_narrow(__int128 wide, number* result) {
+    if (wide > INT64_MAX || wide < INT64_MIN) return NUMBER_OVERFLOW;
+    *result = (number) wide;
+    return NUMBER_OK;
+}
+
+// Scaled results are truncated toward zero, like integer division
+static inline NumberStatus number_mul(number left, number right, number* result) {
+    return __number_narrow((__int128) left * right / NUMBER_SCALE, result);
+}
+
+static inline NumberStatus number_div(number left, number right, number* result) {
+    if (right == 0) return NUMBER_DIVISION_BY_ZERO;
+    return __number_narrow((__int128) left * NUMBER_SCALE / right, result);
+}
+
+#endif /* NUMBER_IS_FLOATING */
+
+// Whether the value can be written as a number literal
+static inline bool number_is_finite(number num) {
+#if NUMBER_IS_FLOATING
+    return num - num == 0;
+#else
+    (void) num;
+    return true;
+#endif
+}
+
+// Converts a number token of the lexer grammar, rounding correctly. A
+// number the backend cannot hold raises CCALC_ERROR_NUMBER
+number parse_number(const char* data, size_t len, Error* error);
+// The same for input that may not fit the backend, false instead of an error
+bool try_parse_number(const char* data, size_t len, number* result);
+// Converts a number of the binary format. Returns why the backend cannot
+// hold it, NULL if it can. Floating point takes anything, rounding to
+// float, integers refuse what is not finite, out of range or, for int64,
+// not an integer. Fixed point rounds to its precision
+const char* number_from_double(double value, number* result);
+const char* number_from_int64(int64_t value, number* result);
 
 #endif /* NUMBER_H */
@@ -0,0 +1,158 @@
+#include "optimizer.h"
+#include "format.h"
+#include "program.h"
+#include "reduce.h"
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Evaluates `left right kind` the way the interpreter would. Returns false
+// if the result has to be left to run time: division by zero must still be
+// reported there, as must integer overflow, and non-finite numbers have no
+// literal to fold into
+bool __fold(unsigned char kind, number left, number right, number* result) {
+    NumberStatus status;
+    switch (kind) {
+    case TOKEN_ADDITION: status = number_add(left, right, result); break;
+    case TOKEN_SUBTRACTION: status = number_sub(left, right, result); break;
+    case TOKEN_MULTIPLICATION: status = number_mul(left, right, result); break;
+    case TOKEN_DIVISION: status = number_div(left, right, result); break;
+    default: return false;
+    }
+    return status == NUMBER_OK && number_is_finite(*result);
+}
+
+// Whether `x right kind` is x for every x, signed zeros and NaNs included.
+// With floats x 0 + is not: -0 + 0 is +0
+bool __is_identity(unsigned char kind, number right) {
+#if NUMBER_IS_FLOATING
+    switch (kind) {
+    case TOKEN_ADDITION: return right == 0 && signbit(right);
+    case TOKEN_SUBTRACTION: return right == 0 && !signbit(right);
+    case TOKEN_MULTIPLICATION:
+    case TOKEN_DIVISION: return right == 1;
+    default: return false;
+    }
+#else
+    switch (kind) {
+    case TOKEN_ADDITION:
+    case TOKEN_SUBTRACTION: return right == 0;
+    case TOKEN_MULTIPLICATION:
+    case TOKEN_DIVISION: return right == NUMBER_SCALE;
+    default: return false;
+    }
+#endif
+}
+
+// The same for a reduction over the values at the end of `operands`
+bool __fold_reduction(unsigned char kind, const number* values, size_t count, number* result) {
+    NumberStatus status;
+    switch (kind) {
+    case TOKEN_SUM: status = reduce_sum(values, count, result); break;
+    case TOKEN_PRODUCT: status = reduce_product(values, count, result); break;
+    case TOKEN_MIN: status = reduce_min(values, count, result); break;
+    case TOKEN_MAX: status = reduce_max(values, count, result); break;
+    case TOKEN_MEAN: status = reduce_mean(values, count, result); break;
+    default: return false;
+    }
+    return status == NUMBER_OK && number_is_finite(*result);
+}
+
+bool __all_numbers(const unsigned char* kinds, size_t len) {
+    for (size_t i = len; i > 0; i--)
+        if (kinds[i - 1] != TOKEN_NUMBER)
+            return false;
+    return true;
+}
+
+// Folds constant subexpressions and drops identity operations in place,
+// starting on a stack `depth` values deep. Returns the depth after the
+// tokens. Optimization stops where the stack would underflow so that the
+// error still happens at the same point
+size_t optimize_token_list(TokenList* tokens, size_t depth) {
+    unsigned char* kinds = tokens->kinds;
+    number* operands = tokens->operands;
+    size_t out = 0;
+    size_t i = 0;
+
+    for (; i < tokens->len && depth != STACK_DEPTH_UNKNOWN; i++) {
+        unsigned char kind = kinds[i];
+
+        if (kind == TOKEN_NUMBER || kind == TOKEN_COLUMN) {
+            depth++;
+        }
+        else if (kind == TOKEN_PRINT) {
+            if (depth < 1) break;
+            depth--;
+        }
+        else if (token_kind_is_reduction(kind)) {
+            size_t pops = reduction_pops(operands[i], depth);
+            if (depth < pops) break;
+            depth -= pops - 1;
+
+            // Constants are folded when all the values are, which for a
+            // whole-stack reduction means the stack holds nothing else
+            number folded;
+            if (out >= pops && __all_numbers(kinds + out - pops, pops)
+                && __fold_reduction(kind, operands + out - pops, pops, &folded)) {
+                out -= pops;
+                operands[out] = folded;
+                out++;
+                continue;
+            }
+        }
+        else {
+            if (depth < 2) break;
+            depth--;
+
+            // The last two emitted tokens are the top two values
+            number folded;
+            if (out >= 2 && kinds[out - 1] == TOKEN_NUMBER && kinds[out - 2] == TOKEN_NUMBER
+                && __fold(kind, operands[out - 2], operands[out - 1], &folded)) {
+                operands[out - 2] = folded;
+                out--;
+                continue;
+            }
+            if (out >= 1 && kinds[out - 1] == TOKEN_NUMBER
+                && __is_identity(kind, operands[out - 1])) {
+                out--;
+                continue;
+            }
+        }
+
+        kinds[out] = kind;
+        operands[out] = operands[i];
+        out++;
+    }
+
+    if (i < tokens->len)
+        depth = STACK_DEPTH_UNKNOWN;
+    memmove(kinds + out, kinds + i, tokens->len - i);
+    memmove(operands + out, operands + i, (tokens->len - i)*sizeof(number));
+    tokens->len = out + (tokens->len - i);
+    return depth;
+}
+
+// Writes a number so that the lexer reads back the same value: the
+// shortest format round-trips, infinities included, and has no '+' in the
+// exponent
+void __dump_number(number num, FILE* file) {
+    char text[NUMBER_TEXT_SIZE];
+    format_number(text, num, NUMBER_FORMAT_SHORTEST);
+    fputs(text, file);
+}
+
+// Writes the tokens back as program text, a line per print
+void dump_token_list(TokenList* tokens, FILE* file) {
+    for (size_t i = 0; i < tokens->len; i++) {
+        if (tokens->kinds[i] == TOKEN_NUMBER)
+            __dump_number(tokens->operands[i], file);
+        else if (tokens->kinds[i] == TOKEN_COLUMN)
+            fprintf(file, "$%zu", (size_t) tokens->operands[i]);
+        else if (token_kind_is_reduction(tokens->kinds[i]) && tokens->operands[i] != 0)
+            fprintf(file, "%zu%s", (size_t) tokens->operands[i], TOKEN_TEXT[tokens->kinds[i]]);
+        else
+            fputs(TOKEN_TEXT[tokens->kinds[i]], file);
+        putc(tokens->kinds[i] == TOKEN_PRINT ? '\n' : ' ', file);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "lexer.h"
+
+// Depth of a stack that has underflowed, nothing is known about it
+#define STACK_DEPTH_UNKNOWN ((size_t) -1)
+
+size_t optimize_token_list(TokenList* tokens, size_t depth);
+void dump_token_list(TokenList* tokens, FILE* file);
+
+#endif /* OPTIMIZER_H */
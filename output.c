@@ -0,0 +1,109 @@
+#include "output.h"
+#include "stats.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+const size_t OUTPUT_MEMORY_INITIAL_SIZE = 1 << 12;
+
+Output* init_output(int fd, NumberFormat format, const Allocator* allocator) {
+    size_t cap = fd == OUTPUT_MEMORY ? OUTPUT_MEMORY_INITIAL_SIZE : OUTPUT_BUFFER_SIZE;
+    char* data = allocate(allocator, cap);
+    if (!data)
+        out_of_memory(allocator, "allocate output buffer");
+
+    Output* output = allocate(allocator, sizeof(Output));
+    if (!output) {
+        release(allocator, data);
+        out_of_memory(allocator, "allocate output struct");
+    }
+
+    output->fd = fd;
+    output->format = format;
+    output->data = data;
+    output->len = 0;
+    output->cap = cap;
+    output->allocator = allocator;
+    return output;
+}
+
+void __write_all(int fd, const char* data, size_t len) {
+    if (len == 0) return;
+    StatsPhase phase = stats_enter(STATS_PHASE_write);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        stats_add(STATS_writes, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "Could not write output: %s\n", strerror(errno));
+            break;
+        }
+        done += n;
+    }
+    stats_add(STATS_bytes_written, done);
+    stats_enter(phase);
+}
+
+// Outputs on OUTPUT_MEMORY keep everything until it is taken
+void output_flush(Output* output) {
+    if (output->fd == OUTPUT_MEMORY) return;
+    __write_all(output->fd, output->data, output->len);
+    output->len = 0;
+}
+
+// Makes room for `len` more bytes, false if they do not fit even then
+bool __output_reserve(Output* output, size_t len) {
+    if (output->len + len <= output->cap) return true;
+    if (output->fd != OUTPUT_MEMORY) {
+        output_flush(output);
+        return len <= output->cap;
+    }
+
+    size_t cap = output->cap;
+    while (output->len + len > cap)
+        cap *= 2;
+    char* new_data = reallocate(output->allocator, output->data, cap);
+    if (!new_data)
+        out_of_memory(output->allocator, "expand output buffer");
+    output->data = new_data;
+    output->cap = cap;
+    return true;
+}
+
+void output_write(Output* output, const char* data, size_t len) {
+    if (!__output_reserve(output, len)) {
+        __write_all(output->fd, data, len);
+        return;
+    }
+    memcpy(output->data + output->len, data, len);
+    output->len += len;
+}
+
+// Formats straight into the buffer, followed by `terminator` unless it is
+// a binary record
+void output_field(Output* output, number num, char terminator) {
+    __output_reserve(output, NUMBER_TEXT_SIZE + 1);
+    char* end = output->data + output->len;
+    end += format_number(end, num, output->format);
+    if (output->format != NUMBER_FORMAT_BINARY)
+        *end++ = terminator;
+    output->len = end - output->data;
+}
+
+// One line per number
+void output_number(Output* output, number num) {
+    output_field(output, num, '\n');
+}
+
+void deinit_output(Output* output) {
+    const Allocator* allocator = output->allocator;
+    output_flush(output);
+    release(allocator, output->data);
+    release(allocator, output);
+}
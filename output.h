@@ -0,0 +1,29 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include "allocator.h"
+#include "format.h"
+
+// Descriptor of an output that collects everything in memory, for output
+// that has to wait for its turn
+#define OUTPUT_MEMORY (-1)
+
+// Buffered writer on a file descriptor, flushed with few large write()s
+typedef struct {
+    int fd;
+    NumberFormat format;
+    char* data;
+    size_t len;
+    size_t cap;
+    const Allocator* allocator;
+} Output;
+
+Output* init_output(int fd, NumberFormat format, const Allocator* allocator);
+void output_write(Output* output, const char* data, size_t len);
+void output_field(Output* output, number num, char terminator);
+void output_number(Output* output, number num);
+void output_flush(Output* output);
+void deinit_output(Output* output);
+
+#endif /* OUTPUT_H */
@@ -0,0 +1,109 @@
+#include "program.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+const size_t MIN_PROGRAM_CAPACITY = 64;
+
+Program* init_program(const Allocator* allocator) {
+    size_t cap = MIN_PROGRAM_CAPACITY;
+    unsigned char* code = allocate(allocator, cap);
+    if (!code)
+        out_of_memory(allocator, "allocate code for program");
+
+    Program* program = allocate(allocator, sizeof(Program));
+    if (!program) {
+        release(allocator, code);
+        out_of_memory(allocator, "allocate program struct");
+    }
+
+    program->code = code;
+    program->len = 0;
+    program->cap = cap;
+    program->allocator = allocator;
+    return program;
+}
+
+void deinit_program(Program* program) {
+    const Allocator* allocator = program->allocator;
+    release(allocator, program->code);
+    release(allocator, program);
+}
+
+void __program_reserve(Program* program, size_t extra) {
+    size_t cap = program->cap;
+    while (program->len + extra > cap)
+        cap *= 2;
+    if (cap == program->cap) return;
+
+    unsigned char* new_code = reallocate(program->allocator, program->code, cap);
+    if (!new_code)
+        out_of_memory(program->allocator, "expand program code");
+
+    program->code = new_code;
+    program->cap = cap;
+}
+
+void emit_op(Program* program, Opcode op) {
+    __program_reserve(program, 1);
+    program->code[program->len++] = op;
+}
+
+void emit_op_number(Program* program, Opcode op, number num) {
+    __program_reserve(program, 1 + sizeof(number));
+    program->code[program->len++] = op;
+    memcpy(program->code + program->len, &num, sizeof(number));
+    program->len += sizeof(number);
+}
+
+const Opcode OPCODE_BY_TOKEN_KIND[/*TokenKind*/] = {
+    [TOKEN_NUMBER] = OP_PUSH,
+    [TOKEN_ADDITION] = OP_ADD,
+    [TOKEN_SUBTRACTION] = OP_SUB,
+    [TOKEN_MULTIPLICATION] = OP_MUL,
+    [TOKEN_DIVISION] = OP_DIV,
+    [TOKEN_PRINT] = OP_PRINT,
+    [TOKEN_SUM] = OP_SUM,
+    [TOKEN_PRODUCT] = OP_PRODUCT,
+    [TOKEN_MIN] = OP_MIN,
+    [TOKEN_MAX] = OP_MAX,
+    [TOKEN_MEAN] = OP_MEAN,
+};
+
+const Opcode FUSED_PUSH_BY_TOKEN_KIND[/*TokenKind*/] = {
+    [TOKEN_ADDITION] = OP_PUSH_ADD,
+    [TOKEN_SUBTRACTION] = OP_PUSH_SUB,
+    [TOKEN_MULTIPLICATION] = OP_PUSH_MUL,
+    [TOKEN_DIVISION] = OP_PUSH_DIV,
+};
+
+bool __token_kind_is_arithmetic(unsigned char kind) {
+    return kind == TOKEN_ADDITION || kind == TOKEN_SUBTRACTION
+        || kind == TOKEN_MULTIPLICATION || kind == TOKEN_DIVISION;
+}
+
+// Replaces the program with the compiled tokens
+void compile_token_list(Program* program, TokenList* tokens) {
+    program->len = 0;
+
+    for (size_t i = 0; i < tokens->len; i++) {
+        unsigned char kind = tokens->kinds[i];
+        if (token_kind_is_reduction(kind)) {
+            emit_op_number(program, OPCODE_BY_TOKEN_KIND[kind], tokens->operands[i]);
+            continue;
+        }
+        if (kind != TOKEN_NUMBER) {
+            emit_op(program, OPCODE_BY_TOKEN_KIND[kind]);
+            continue;
+        }
+
+        if (i + 1 < tokens->len && __token_kind_is_arithmetic(tokens->kinds[i + 1])) {
+            emit_op_number(program, FUSED_PUSH_BY_TOKEN_KIND[tokens->kinds[i + 1]],
+                           tokens->operands[i]);
+            i++;
+        }
+        else emit_op_number(program, OP_PUSH, tokens->operands[i]);
+    }
+
+    emit_op(program, OP_HALT);
+}
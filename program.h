@@ -0,0 +1,60 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <stddef.h>
+#include "allocator.h"
+#include "lexer.h"
+
+// Opcodes with their stack effect and whether a `number` immediate follows
+// the opcode byte in the code. OP_PUSH_<op> are superinstructions for a
+// constant pushed right before an arithmetic instruction. The immediate of
+// a reduction is its count, 0 for the whole stack, and its pops a minimum
+#define OPCODE_LIST \
+    X(OP_HALT, 0, 0, false) \
+    X(OP_PUSH, 0, 1, true) \
+    X(OP_ADD, 2, 1, false) \
+    X(OP_SUB, 2, 1, false) \
+    X(OP_MUL, 2, 1, false) \
+    X(OP_DIV, 2, 1, false) \
+    X(OP_PRINT, 1, 0, false) \
+    X(OP_PUSH_ADD, 1, 1, true) \
+    X(OP_PUSH_SUB, 1, 1, true) \
+    X(OP_PUSH_MUL, 1, 1, true) \
+    X(OP_PUSH_DIV, 1, 1, true) \
+    X(OP_SUM, 1, 1, true) \
+    X(OP_PRODUCT, 1, 1, true) \
+    X(OP_MIN, 1, 1, true) \
+    X(OP_MAX, 1, 1, true) \
+    X(OP_MEAN, 1, 1, true)
+
+typedef enum {
+#define X(op, pops, pushes, imm) \
+    op,
+    OPCODE_LIST
+#undef X
+    OPCODE_COUNT
+} Opcode;
+
+static inline bool opcode_is_reduction(unsigned char op) {
+    return op >= OP_SUM && op <= OP_MEAN;
+}
+
+// Values a reduction with the given count takes off a stack of the given
+// depth, at least one even from an empty stack so that it underflows
+static inline size_t reduction_pops(number count, size_t depth) {
+    return count != 0 ? (size_t) count : depth != 0 ? depth : 1;
+}
+
+// Bytecode terminated by OP_HALT, immediates are stored unaligned
+typedef struct {
+    unsigned char* code;
+    size_t len;
+    size_t cap;
+    const Allocator* allocator;
+} Program;
+
+Program* init_program(const Allocator* allocator);
+void compile_token_list(Program* program, TokenList* tokens);
+void deinit_program(Program* program);
+
+#endif /* PROGRAM_H */
@@ -0,0 +1,188 @@
+#include "reduce.h"
+
+// The loops keep REDUCE_LANES independent accumulators, a vector's worth,
+// which the compiler turns into SIMD code without reassociating anything.
+// Where the loader can pick by CPU they are built for AVX2 as well
+#if defined(__x86_64__) && defined(__GLIBC__) && !defined(CCALC_NO_TARGET_CLONES)
+#define REDUCE_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define REDUCE_KERNEL
+#endif
+
+#define REDUCE_LANES (32 / sizeof(number))
+
+#if NUMBER_IS_FLOATING
+#define __IS_NAN(value) ((value) != (value))
+#else
+#define __IS_NAN(value) false
+#endif
+
+// Whether `value` replaces `kept` as the minimum, a NaN always doing so
+// and never being replaced
+static inline bool __is_min(number value, number kept) {
+    return value < kept || __IS_NAN(value);
+}
+
+static inline bool __is_max(number value, number kept) {
+    return value > kept || __IS_NAN(value);
+}
+
+#define REDUCE_EXTREMUM(name) \
+    REDUCE_KERNEL \
+    NumberStatus reduce_##name(const number* values, size_t count, number* result) { \
+        number lanes[REDUCE_LANES]; \
+        for (size_t j = 0; j < REDUCE_LANES; j++) \
+            lanes[j] = values[0]; \
+        size_t i = 0; \
+        for (; i + REDUCE_LANES <= count; i += REDUCE_LANES) \
+            for (size_t j = 0; j < REDUCE_LANES; j++) \
+                lanes[j] = __is_##name(values[i + j], lanes[j]) ? values[i + j] : lanes[j]; \
+        number kept = values[0]; \
+        for (; i < count; i++) \
+            kept = __is_##name(values[i], kept) ? values[i] : kept; \
+        for (size_t j = 0; j < REDUCE_LANES; j++) \
+            kept = __is_##name(lanes[j], kept) ? lanes[j] : kept; \
+        *result = kept; \
+        return NUMBER_OK; \
+    }
+
+REDUCE_EXTREMUM(min)
+REDUCE_EXTREMUM(max)
+
+#if NUMBER_IS_FLOATING
+
+#ifndef CCALC_COMPENSATED_SUM
+
+// Values summed straight into the lanes, longer runs being split in halves
+// whose sums are added, so every value goes through about
+// log2(count / REDUCE_BLOCK) + REDUCE_BLOCK / REDUCE_LANES additions
+#define REDUCE_BLOCK 256
+
+// -0.0 is the identity of addition, 0.0 would turn a sum of -0.0 into 0.0
+REDUCE_KERNEL
+number __sum_block(const number* values, size_t count) {
+    number lanes[REDUCE_LANES];
+    for (size_t j = 0; j < REDUCE_LANES; j++)
+        lanes[j] = -0.0;
+    size_t i = 0;
+    for (; i + REDUCE_LANES <= count; i += REDUCE_LANES)
+        for (size_t j = 0; j < REDUCE_LANES; j++)
+            lanes[j] += values[i + j];
+    number sum = -0.0;
+    for (; i < count; i++)
+        sum += values[i];
+    for (size_t j = 0; j < REDUCE_LANES; j++)
+        sum += lanes[j];
+    return sum;
+}
+
+number __sum_pairwise(const number* values, size_t count) {
+    if (count <= REDUCE_BLOCK)
+        return __sum_block(values, count);
+    // Split on a block boundary
+    size_t half = count / 2 / REDUCE_BLOCK * REDUCE_BLOCK;
+    if (half == 0)
+        half = REDUCE_BLOCK;
+    return __sum_pairwise(values, half) + __sum_pairwise(values + half, count - half);
+}
+
+NumberStatus reduce_sum(const number* values, size_t count, number* result) {
+    *result = __sum_pairwise(values, count);
+    return NUMBER_OK;
+}
+
+#else
+
+// Neumaier's variant of Kahan summation, the rounding error of every
+// addition being collected in `compensation`
+static inline void __neumaier_add(number* sum, number* compensation, number value) {
+    number total = *sum + value;
+    number sum_abs = *sum < 0 ? -*sum : *sum;
+    number value_abs = value < 0 ? -value : value;
+    *compensation += sum_abs >= value_abs ? (*sum - total) + value : (value - total) + *sum;
+    *sum = total;
+}
+
+REDUCE_KERNEL
+NumberStatus reduce_sum(const number* values, size_t count, number* result) {
+    number sums[REDUCE_LANES];
+    number compensations[REDUCE_LANES];
+    for (size_t j = 0; j < REDUCE_LANES; j++) {
+        sums[j] = -0.0;
+        compensations[j] = 0;
+    }
+    size_t i = 0;
+    for (; i + REDUCE_LANES <= count; i += REDUCE_LANES)
+        for (size_t j = 0; j < REDUCE_LANES; j++)
+            __neumaier_add(&sums[j], &compensations[j], values[i + j]);
+    number sum = -0.0;
+    number compensation = 0;
+    for (; i < count; i++)
+        __neumaier_add(&sum, &compensation, values[i]);
+    for (size_t j = 0; j < REDUCE_LANES; j++) {
+        __neumaier_add(&sum, &compensation, sums[j]);
+        __neumaier_add(&sum, &compensation, compensations[j]);
+    }
+    *result = sum + compensation;
+    return NUMBER_OK;
+}
+
+#endif /* CCALC_COMPENSATED_SUM */
+
+REDUCE_KERNEL
+NumberStatus reduce_product(const number* values, size_t count, number* result) {
+    number lanes[REDUCE_LANES];
+    for (size_t j = 0; j < REDUCE_LANES; j++)
+        lanes[j] = 1;
+    size_t i = 0;
+    for (; i + REDUCE_LANES <= count; i += REDUCE_LANES)
+        for (size_t j = 0; j < REDUCE_LANES; j++)
+            lanes[j] *= values[i + j];
+    number product = 1;
+    for (; i < count; i++)
+        product *= values[i];
+    for (size_t j = 0; j < REDUCE_LANES; j++)
+        product *= lanes[j];
+    *result = product;
+    return NUMBER_OK;
+}
+
+NumberStatus reduce_mean(const number* values, size_t count, number* result) {
+    number sum;
+    reduce_sum(values, count, &sum);
+    *result = sum / count;
+    return NUMBER_OK;
+}
+
+#else /* integers, scaled by NUMBER_SCALE */
+
+// No count the verifier lets through can overflow the wide sum
+__int128 __sum_wide(const number* values, size_t count) {
+    __int128 sum = 0;
+    for (size_t i = 0; i < count; i++)
+        sum += values[i];
+    return sum;
+}
+
+NumberStatus reduce_sum(const number* values, size_t count, number* result) {
+    return __number_narrow(__sum_wide(values, count), result);
+}
+
+// Multiplied bottom up, overflowing and truncating where a chain of '*'
+// would
+NumberStatus reduce_product(const number* values, size_t count, number* result) {
+    number product = values[0];
+    for (size_t i = 1; i < count; i++) {
+        NumberStatus status = number_mul(product, values[i], &product);
+        if (status != NUMBER_OK)
+            return status;
+    }
+    *result = product;
+    return NUMBER_OK;
+}
+
+NumberStatus reduce_mean(const number* values, size_t count, number* result) {
+    return __number_narrow(__sum_wide(values, count) / (__int128) count, result);
+}
+
+#endif /* NUMBER_IS_FLOATING */
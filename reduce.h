@@ -0,0 +1,20 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stddef.h>
+#include "number.h"
+
+// Kernels of the reductions over `count` values, count > 0, bottom of the
+// stack first. Like the arithmetic kernels they only write the result on
+// NUMBER_OK. Floating point sums are pairwise, or compensated when built
+// with CCALC_COMPENSATED_SUM, so their error grows with log(count) at
+// most rather than with count as for a chain of additions
+NumberStatus reduce_sum(const number* values, size_t count, number* result);
+NumberStatus reduce_product(const number* values, size_t count, number* result);
+// A NaN anywhere makes the result NaN
+NumberStatus reduce_min(const number* values, size_t count, number* result);
+NumberStatus reduce_max(const number* values, size_t count, number* result);
+// Integer means are truncated toward zero, like integer division
+NumberStatus reduce_mean(const number* values, size_t count, number* result);
+
+#endif /* REDUCE_H */
@@ -0,0 +1,101 @@
+#include "scan.h"
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_HAVE_X86 1
+#endif
+
+// Space is what isspace() accepts in the "C" locale: ' ' and '\t'..'\r'
+bool __byte_is_digits(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool __byte_is_space(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+bool __byte_is_nonspace(unsigned char c) {
+    return !__byte_is_space(c);
+}
+
+#define X(name) \
+    size_t __scan_##name##_scalar(const unsigned char* data, size_t len) { \
+        size_t i = 0; \
+        while (i < len && __byte_is_##name(data[i])) \
+            i++; \
+        return i; \
+    }
+SCAN_CLASS_LIST
+#undef X
+
+#ifdef SCAN_HAVE_X86
+
+// Masks have 0xFF in every lane holding a byte of the class. Unsigned
+// range checks are done as min(v - lo, span) == v - lo
+#define SIMD_ISA_LIST \
+    X(sse2, __m128i, 16, _mm_, si128) \
+    X(avx2, __m256i, 32, _mm256_, si256)
+
+#define X(isa, vec, width, p, si) \
+    __attribute__((target(#isa))) \
+    static inline vec __##isa##_in_range(vec v, char lo, char span) { \
+        vec shifted = p##sub_epi8(v, p##set1_epi8(lo)); \
+        return p##cmpeq_epi8(p##min_epu8(shifted, p##set1_epi8(span)), shifted); \
+    } \
+    __attribute__((target(#isa))) \
+    static inline vec __##isa##_digits_mask(vec v) { \
+        return __##isa##_in_range(v, '0', 9); \
+    } \
+    __attribute__((target(#isa))) \
+    static inline vec __##isa##_space_mask(vec v) { \
+        return p##or_##si(__##isa##_in_range(v, '\t', '\r' - '\t'), \
+                          p##cmpeq_epi8(v, p##set1_epi8(' '))); \
+    } \
+    __attribute__((target(#isa))) \
+    static inline vec __##isa##_nonspace_mask(vec v) { \
+        return p##xor_##si(__##isa##_space_mask(v), p##set1_epi8(-1)); \
+    } \
+    SCAN_ISA_CLASS(isa, vec, width, p, si, digits) \
+    SCAN_ISA_CLASS(isa, vec, width, p, si, space) \
+    SCAN_ISA_CLASS(isa, vec, width, p, si, nonspace)
+#define SCAN_ISA_CLASS(isa, vec, width, p, si, name) \
+    __attribute__((target(#isa))) \
+    size_t __scan_##name##_##isa(const unsigned char* data, size_t len) { \
+        size_t i = 0; \
+        for (; i + width <= len; i += width) { \
+            vec v = p##loadu_##si((const vec*) (data + i)); \
+            unsigned int mask = (unsigned int) p##movemask_epi8(__##isa##_##name##_mask(v)); \
+            if (mask != (unsigned int) ((1ull << width) - 1)) \
+                return i + __builtin_ctz(~mask); \
+        } \
+        return i + __scan_##name##_scalar(data + i, len - i); \
+    }
+SIMD_ISA_LIST
+#undef X
+#undef SCAN_ISA_CLASS
+
+#endif /* SCAN_HAVE_X86 */
+
+#define X(name) \
+    size_t (*scan_##name)(const unsigned char* data, size_t len) = __scan_##name##_scalar;
+SCAN_CLASS_LIST
+#undef X
+
+void init_scanners(void) {
+#ifdef SCAN_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+#define X(name) \
+        scan_##name = __scan_##name##_avx2;
+        SCAN_CLASS_LIST
+#undef X
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+#define X(name) \
+        scan_##name = __scan_##name##_sse2;
+        SCAN_CLASS_LIST
+#undef X
+    }
+#endif
+}
@@ -0,0 +1,21 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Each scanner returns the length of the longest prefix of data[0..len)
+// made of its byte class. The fastest implementation for the CPU is picked
+// by init_scanners(), which must be called before any of them
+#define SCAN_CLASS_LIST \
+    X(digits) \
+    X(space) \
+    X(nonspace)
+
+#define X(name) \
+    extern size_t (*scan_##name)(const unsigned char* data, size_t len);
+SCAN_CLASS_LIST
+#undef X
+
+void init_scanners(void);
+
+#endif /* SCAN_H */
@@ -0,0 +1,517 @@
+// For accept4()
+#define _GNU_SOURCE
+#include "server.h"
+#include "ccalc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// One event loop thread serves every client. Evaluating a short program
+// takes microseconds, less than handing it to another thread would. The
+// catch is that every other client waits while a long request, up to
+// MAX_REQUEST_SIZE of text, runs
+
+const int MAX_EVENTS = 64;
+const size_t CONNECTION_BUFFER_SIZE = 1 << 12;
+
+// Latencies are counted in a log-linear histogram, every power of two
+// nanoseconds split into 2^LATENCY_SUB_BITS buckets, so percentiles are
+// within 1/16 of the real value whatever the number of requests
+#define LATENCY_SUB_BITS 4
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} LatencyHistogram;
+
+size_t __latency_bucket(uint64_t ns) {
+    if (ns < (1u << LATENCY_SUB_BITS)) return ns;
+    int exp = 63 - __builtin_clzll(ns);
+    uint64_t sub = (ns >> (exp - LATENCY_SUB_BITS)) & ((1u << LATENCY_SUB_BITS) - 1);
+    return ((size_t) (exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+// The longest latency counted in the bucket
+uint64_t __latency_bucket_top(size_t bucket) {
+    if (bucket < (1u << LATENCY_SUB_BITS)) return bucket;
+    int exp = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1u << LATENCY_SUB_BITS) - 1);
+    return (((1ull << LATENCY_SUB_BITS) + sub + 1) << (exp - LATENCY_SUB_BITS)) - 1;
+}
+
+void record_latency(LatencyHistogram* histogram, uint64_t ns) {
+    histogram->counts[__latency_bucket(ns)]++;
+    histogram->total++;
+    if (ns > histogram->max)
+        histogram->max = ns;
+}
+
+uint64_t latency_percentile(LatencyHistogram* histogram, double percentile) {
+    uint64_t rank = (uint64_t) (percentile / 100 * histogram->total);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t top = __latency_bucket_top(i);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void report_latency(LatencyHistogram* histogram) {
+    if (histogram->total == 0) {
+        fprintf(stderr, "0 requests\n");
+        return;
+    }
+    fprintf(stderr, "%llu requests, latency p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+            "p99.9 %.1f us, max %.1f us\n",
+            (unsigned long long) histogram->total,
+            latency_percentile(histogram, 50) / 1e3,
+            latency_percentile(histogram, 90) / 1e3,
+            latency_percentile(histogram, 99) / 1e3,
+            latency_percentile(histogram, 99.9) / 1e3,
+            histogram->max / 1e3);
+}
+
+uint64_t __now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// A growable byte buffer
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+void __buffer_reserve(Buffer* buffer, size_t extra) {
+    size_t cap = buffer->cap ? buffer->cap : CONNECTION_BUFFER_SIZE;
+    while (buffer->len + extra > cap)
+        cap *= 2;
+    if (cap == buffer->cap) return;
+
+    char* new_data = realloc(buffer->data, cap);
+    if (!new_data) {
+        fprintf(stderr, "Could not expand connection buffer\n");
+        abort();
+    }
+    buffer->data = new_data;
+    buffer->cap = cap;
+}
+
+void __buffer_append(Buffer* buffer, const void* data, size_t len) {
+    __buffer_reserve(buffer, len);
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+// Drops the first `len` bytes
+void __buffer_consume(Buffer* buffer, size_t len) {
+    if (len == 0) return;
+    memmove(buffer->data, buffer->data + len, buffer->len - len);
+    buffer->len -= len;
+}
+
+typedef struct {
+    int fd;
+    size_t slot; // in Server.connections
+    Buffer requests; // read, not answered yet
+    Buffer replies; // not written yet
+    bool writing; // waiting for the socket to take replies
+    bool finished; // the client will not send any more
+} Connection;
+
+typedef struct {
+    int epoll;
+    int listener;
+    int signals;
+    CCalc* calc; // requests are evaluated one at a time
+    Connection** connections;
+    size_t connection_count;
+    size_t connection_cap;
+    LatencyHistogram latency;
+} Server;
+
+int __listen(const char* path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0
+        || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Could not listen on '%s': %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void __watch(Server* server, int op, int fd, uint32_t events, void* data) {
+    struct epoll_event event = {.events = events, .data.ptr = data};
+    if (epoll_ctl(server->epoll, op, fd, &event) < 0) {
+        fprintf(stderr, "Could not watch socket: %s\n", strerror(errno));
+        abort();
+    }
+}
+
+void __accept_connections(Server* server) {
+    for (;;) {
+        int fd = accept4(server->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "Could not accept client: %s\n", strerror(errno));
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        Connection* connection = calloc(1, sizeof(Connection));
+        if (!connection) {
+            fprintf(stderr, "Could not allocate connection struct\n");
+            abort();
+        }
+        if (server->connection_count == server->connection_cap) {
+            size_t cap = server->connection_cap ? server->connection_cap*2 : 16;
+            Connection** connections = realloc(server->connections, cap*sizeof(Connection*));
+            if (!connections) {
+                fprintf(stderr, "Could not expand connection list\n");
+                abort();
+            }
+            server->connections = connections;
+            server->connection_cap = cap;
+        }
+
+        connection->fd = fd;
+        connection->slot = server->connection_count;
+        server->connections[server->connection_count++] = connection;
+        __watch(server, EPOLL_CTL_ADD, fd, EPOLLIN, connection);
+    }
+}
+
+void __close_connection(Server* server, Connection* connection) {
+    close(connection->fd);
+    Connection* last = server->connections[--server->connection_count];
+    server->connections[connection->slot] = last;
+    last->slot = connection->slot;
+    free(connection->requests.data);
+    free(connection->replies.data);
+    free(connection);
+}
+
+// Reads whatever has arrived, false if the connection failed
+bool __read_requests(Connection* connection) {
+    Buffer* requests = &connection->requests;
+    for (;;) {
+        __buffer_reserve(requests, CONNECTION_BUFFER_SIZE);
+        ssize_t n = read(connection->fd, requests->data + requests->len, requests->cap - requests->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        if (n == 0) {
+            connection->finished = true;
+            return true;
+        }
+        requests->len += n;
+    }
+}
+
+// Evaluates every complete request, false if one is too large. Latency
+// runs from `start`, when the requests were read, to the reply being
+// ready, so requests that come in together wait for the ones before them
+bool __answer_requests(Server* server, Connection* connection, uint64_t start) {
+    Buffer* requests = &connection->requests;
+    size_t offset = 0;
+    bool ok = true;
+    while (requests->len - offset >= sizeof(uint32_t)) {
+        uint32_t len;
+        memcpy(&len, requests->data + offset, sizeof(len));
+        if (len > MAX_REQUEST_SIZE) {
+            ok = false;
+            break;
+        }
+        if (requests->len - offset - sizeof(len) < len) break;
+
+        const char* text = requests->data + offset + sizeof(len);
+        CCalcStatus status = ccalc_evaluate_buffer(server->calc, text, len);
+        size_t output_len, diagnostics_len;
+        const char* output = ccalc_output(server->calc, &output_len);
+        const char* diagnostics = ccalc_diagnostics(server->calc, &diagnostics_len);
+        const char* message = ccalc_error_message(server->calc);
+        size_t message_len = status == CCALC_OK ? 0 : strlen(message);
+        ReplyHeader header = {
+            .status = status,
+            .output_len = output_len,
+            .message_len = diagnostics_len + message_len + (status != CCALC_OK),
+        };
+        __buffer_append(&connection->replies, &header, sizeof(header));
+        __buffer_append(&connection->replies, output, output_len);
+        __buffer_append(&connection->replies, diagnostics, diagnostics_len);
+        __buffer_append(&connection->replies, message, message_len);
+        if (status != CCALC_OK)
+            __buffer_append(&connection->replies, "\n", 1);
+
+        offset += sizeof(len) + len;
+        record_latency(&server->latency, __now_ns() - start);
+    }
+    __buffer_consume(requests, offset);
+    return ok;
+}
+
+// Writes what the socket takes, false if the connection failed
+bool __write_replies(Connection* connection) {
+    Buffer* replies = &connection->replies;
+    size_t done = 0;
+    while (done < replies->len) {
+        ssize_t n = write(connection->fd, replies->data + done, replies->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0)
+            return false;
+        done += n;
+    }
+    __buffer_consume(replies, done);
+    return true;
+}
+
+void __handle_connection(Server* server, Connection* connection, uint32_t events) {
+    bool ok = true;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ok = __read_requests(connection);
+        ok = ok && __answer_requests(server, connection, __now_ns());
+    }
+    ok = ok && __write_replies(connection);
+
+    bool done = connection->finished && connection->replies.len == 0;
+    if (!ok || done) {
+        __close_connection(server, connection);
+        return;
+    }
+
+    // Stop reading from clients that do not take their replies
+    bool writing = connection->replies.len > 0;
+    if (writing != connection->writing) {
+        uint32_t interest = writing ? EPOLLOUT : EPOLLIN;
+        __watch(server, EPOLL_CTL_MOD, connection->fd, interest, connection);
+        connection->writing = writing;
+    }
+}
+
+// Returns false when it is time to stop
+bool __handle_signals(Server* server) {
+    struct signalfd_siginfo info;
+    while (read(server->signals, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo != SIGUSR1)
+            return false;
+        report_latency(&server->latency);
+    }
+    return true;
+}
+
+int serve(const char* path) {
+    Server server = {.epoll = -1, .listener = -1, .signals = -1};
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    server.listener = __listen(path);
+    if (server.listener < 0)
+        return EXIT_FAILURE;
+    server.signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    server.epoll = epoll_create1(EPOLL_CLOEXEC);
+    server.calc = ccalc_create(NULL);
+    if (server.signals < 0 || server.epoll < 0 || !server.calc) {
+        fprintf(stderr, "Could not start server: %s\n", strerror(errno));
+        abort();
+    }
+    // The listener and the signals are told apart from connections by
+    // their addresses
+    __watch(&server, EPOLL_CTL_ADD, server.listener, EPOLLIN, &server.listener);
+    __watch(&server, EPOLL_CTL_ADD, server.signals, EPOLLIN, &server.signals);
+
+    struct epoll_event events[MAX_EVENTS];
+    bool running = true;
+    while (running) {
+        int count = epoll_wait(server.epoll, events, MAX_EVENTS, -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0) {
+            fprintf(stderr, "Could not wait for clients: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            void* source = events[i].data.ptr;
+            if (source == &server.listener)
+                __accept_connections(&server);
+            else if (source == &server.signals)
+                running = __handle_signals(&server) && running;
+            else
+                __handle_connection(&server, source, events[i].events);
+        }
+    }
+
+    while (server.connection_count > 0)
+        __close_connection(&server, server.connections[0]);
+    free(server.connections);
+    ccalc_destroy(server.calc);
+    close(server.epoll);
+    close(server.signals);
+    close(server.listener);
+    unlink(path);
+    report_latency(&server.latency);
+    return EXIT_SUCCESS;
+}
+
+bool __send_all(int fd, const void* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char*) data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+bool __receive_all(int fd, void* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*) data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// The whole file, read into `buffer`. False if it cannot be read
+bool __read_file(const char* filename, Buffer* buffer) {
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    buffer->len = 0;
+    bool ok = true;
+    for (;;) {
+        __buffer_reserve(buffer, CONNECTION_BUFFER_SIZE);
+        ssize_t n = read(fd, buffer->data + buffer->len, buffer->cap - buffer->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "Could not read '%s': %s\n", filename, strerror(errno));
+            ok = false;
+        }
+        if (n <= 0) break;
+        buffer->len += n;
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return ok;
+}
+
+// Sends a request and waits for its reply, false if the connection failed
+bool __exchange(int fd, Buffer* request, ReplyHeader* header, Buffer* reply) {
+    uint32_t len = request->len;
+    if (!__send_all(fd, &len, sizeof(len)) || !__send_all(fd, request->data, len)
+        || !__receive_all(fd, header, sizeof(*header)))
+        return false;
+
+    reply->len = 0;
+    size_t reply_len = (size_t) header->output_len + header->message_len;
+    __buffer_reserve(reply, reply_len);
+    if (!__receive_all(fd, reply->data, reply_len))
+        return false;
+    reply->len = reply_len;
+    return true;
+}
+
+// One request per file, a file that fails stops the rest like it would
+// stop ccalc
+int call_server(const char* path, int filec, char** filenames) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        fprintf(stderr, "Could not connect to '%s': %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return EXIT_FAILURE;
+    }
+
+    char* stdin_only[] = {"-"};
+    if (filec == 0) {
+        filec = 1;
+        filenames = stdin_only;
+    }
+
+    Buffer request = {NULL, 0, 0};
+    Buffer reply = {NULL, 0, 0};
+    int result = EXIT_SUCCESS;
+    for (int i = 0; i < filec && result == EXIT_SUCCESS; i++) {
+        if (!__read_file(filenames[i], &request)) {
+            result = EXIT_FAILURE;
+            break;
+        }
+        if (request.len > MAX_REQUEST_SIZE) {
+            fprintf(stderr, "'%s' is too large for a request\n", filenames[i]);
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        ReplyHeader header;
+        if (!__exchange(fd, &request, &header, &reply)) {
+            fprintf(stderr, "Lost connection to '%s'\n", path);
+            result = EXIT_FAILURE;
+            break;
+        }
+        fwrite(reply.data, 1, header.output_len, stdout);
+        fflush(stdout);
+        fwrite(reply.data + header.output_len, 1, header.message_len, stderr);
+        if (header.status != CCALC_OK)
+            result = EXIT_FAILURE;
+    }
+
+    free(reply.data);
+    free(request.data);
+    close(fd);
+    return result;
+}
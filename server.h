@@ -0,0 +1,28 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+// Requests are a uint32_t length followed by that much program text, each
+// one evaluated on an empty stack. Replies are a ReplyHeader followed by
+// the output and the messages, which are what ccalc would print to stderr:
+// the unused values or the error, a line each. Integers are in native byte
+// order, the socket never leaves the machine
+typedef struct {
+    uint32_t status; // a CCalcStatus
+    uint32_t output_len;
+    uint32_t message_len;
+} ReplyHeader;
+
+#define MAX_REQUEST_SIZE (64u << 20)
+
+// Evaluates requests from any number of clients of the Unix socket at
+// `path` until SIGINT or SIGTERM, SIGUSR1 reports request latency so far.
+// Requests run one at a time, so a long one holds up every client. Returns
+// the exit status
+int serve(const char* path);
+// Sends every file as a request to the daemon at `path`, printing the
+// replies like running the files would
+int call_server(const char* path, int filec, char** filenames);
+
+#endif /* SERVER_H */
@@ -1,60 +1,213 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "stack.h"
+#include "stats.h"
+#if NUMSTACK_RESERVE_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 const size_t NUMSTACK_INIT_CAP = 32;
+// Slots before data[0], the scratch one and padding that keeps data as
+// aligned as the allocation for the SIMD code of map mode
+const size_t NUMSTACK_SCRATCH = 16 / sizeof(number);
+// Highest limit, far enough from SIZE_MAX for sizes in bytes not to wrap
+const size_t NUMSTACK_MAX_LIMIT = SIZE_MAX / 2 / sizeof(number);
+// Address space reserved up front. Every interpreter has a stack, one per
+// job with --jobs, so they start with this much rather than their limit
+// and extend the reservation when they outgrow it
+const size_t NUMSTACK_RESERVE_SIZE = (size_t) 64 << 20;
 
-numstack* numstack_init(void) {
-    number* data = calloc(NUMSTACK_INIT_CAP, sizeof(number));
-    if (!data) {
-        fprintf(stderr, "Could not allocate data for numstack\n");
-        abort();
-    }
+numstack* numstack_init(const Allocator* allocator) {
+    number* data = allocate(allocator, (NUMSTACK_INIT_CAP + NUMSTACK_SCRATCH)*sizeof(number));
+    if (!data)
+        out_of_memory(allocator, "allocate data for numstack");
 
-    numstack* stack = malloc(sizeof(numstack));
+    numstack* stack = allocate(allocator, sizeof(numstack));
     if (!stack) {
-        free(data);
-        fprintf(stderr, "Could not allocate numstack header\n");
-        abort();
+        release(allocator, data);
+        out_of_memory(allocator, "allocate numstack header");
     }
 
-    stack->data = data;
+    for (size_t i = 0; i < NUMSTACK_SCRATCH; i++)
+        data[i] = 0;
+    stack->data = data + NUMSTACK_SCRATCH;
     stack->offset = 0;
     stack->cap = NUMSTACK_INIT_CAP;
+    stack->limit = NUMSTACK_MAX_LIMIT;
+    stack->reserved = 0;
+    stack->allocator = allocator;
     return stack;
 }
 
-void __numstack_resize(numstack* stack) {
-    number* new_data = realloc(stack->data, stack->cap*2*sizeof(number));
-    if (!new_data) {
-        numstack_deinit(stack);
-        fprintf(stderr, "Could not expand numstack\n");
-        abort();
+#if NUMSTACK_RESERVE_SUPPORTED
+
+size_t __round_to_pages(size_t size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// Makes whole pages up to at least `cap` values readable and writable.
+// They are zero until written, and only count against the memory of the
+// system from here on
+void __numstack_commit(numstack* stack, size_t cap) {
+    size_t size = __round_to_pages((cap + NUMSTACK_SCRATCH)*sizeof(number));
+    if (size > stack->reserved)
+        size = stack->reserved;
+    if (mprotect(stack->data - NUMSTACK_SCRATCH, size, PROT_READ | PROT_WRITE) != 0)
+        out_of_memory(stack->allocator, "commit memory for numstack");
+
+    cap = size/sizeof(number) - NUMSTACK_SCRATCH;
+    stack->cap = cap < stack->limit ? cap : stack->limit;
+    stats_add(STATS_numstack_resizes, 1);
+}
+
+// The values and the scratch slots move to memory from the allocator, for
+// a stack that cannot get the address space it needs
+void __numstack_leave_reservation(numstack* stack) {
+    size_t size = (stack->cap + NUMSTACK_SCRATCH)*sizeof(number);
+    number* data = allocate(stack->allocator, size);
+    if (!data)
+        out_of_memory(stack->allocator, "move numstack out of its reservation");
+    memcpy(data, stack->data - NUMSTACK_SCRATCH, size);
+    munmap(stack->data - NUMSTACK_SCRATCH, stack->reserved);
+    stack->data = data + NUMSTACK_SCRATCH;
+    stack->reserved = 0;
+}
+
+// Doubles the reservation until it has `size` bytes, within the limit.
+// In place if the address space right after it is free, else the committed
+// pages are copied to a new reservation
+void __numstack_extend(numstack* stack, size_t size) {
+    size_t most = __round_to_pages((stack->limit + NUMSTACK_SCRATCH)*sizeof(number));
+    size_t reserved = stack->reserved;
+    while (reserved < size && reserved < most)
+        reserved *= 2;
+    if (reserved > most)
+        reserved = most;
+
+    char* start = (char*) (stack->data - NUMSTACK_SCRATCH);
+    size_t extra = reserved - stack->reserved;
+    void* tail = mmap(start + stack->reserved, extra, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tail == start + stack->reserved) {
+        stack->reserved = reserved;
+        return;
     }
+    if (tail != MAP_FAILED)
+        munmap(tail, extra);
 
-    stack->data = new_data;
-    stack->cap *= 2;
+    void* range = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t committed = __round_to_pages((stack->cap + NUMSTACK_SCRATCH)*sizeof(number));
+    if (range == MAP_FAILED || mprotect(range, committed, PROT_READ | PROT_WRITE) != 0) {
+        if (range != MAP_FAILED)
+            munmap(range, reserved);
+        __numstack_leave_reservation(stack);
+        return;
+    }
+    memcpy(range, start, (stack->cap + NUMSTACK_SCRATCH)*sizeof(number));
+    munmap(start, stack->reserved);
+    stack->data = (number*) range + NUMSTACK_SCRATCH;
+    stack->reserved = reserved;
 }
 
-void numstack_deinit(numstack* stack) {
-    free(stack->data);
-    free(stack);
+// A reservation that cannot be had, past an address space limit of the
+// process say, leaves the stack to the allocator
+numstack* numstack_init_reserved(const Allocator* allocator, size_t limit) {
+    if (limit > NUMSTACK_MAX_LIMIT)
+        limit = NUMSTACK_MAX_LIMIT;
+    size_t reserved = __round_to_pages((limit + NUMSTACK_SCRATCH)*sizeof(number));
+    if (reserved > NUMSTACK_RESERVE_SIZE)
+        reserved = NUMSTACK_RESERVE_SIZE;
+    void* range = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (range == MAP_FAILED) {
+        numstack* stack = numstack_init(allocator);
+        stack->limit = limit;
+        if (stack->cap > limit)
+            stack->cap = limit;
+        return stack;
+    }
+
+    numstack* stack = allocate(allocator, sizeof(numstack));
+    if (!stack) {
+        munmap(range, reserved);
+        out_of_memory(allocator, "allocate numstack header");
+    }
+
+    stack->data = (number*) range + NUMSTACK_SCRATCH;
+    stack->offset = 0;
+    stack->limit = limit;
+    stack->reserved = reserved;
+    stack->allocator = allocator;
+    __numstack_commit(stack, NUMSTACK_INIT_CAP);
+    return stack;
 }
 
-void numstack_push(numstack* stack, number num) {
-    if (stack->offset == stack->cap)
-        __numstack_resize(stack);
+#else
 
-    stack->data[stack->offset] = num;
-    stack->offset++;
+numstack* numstack_init_reserved(const Allocator* allocator, size_t limit) {
+    numstack* stack = numstack_init(allocator);
+    stack->limit = limit < NUMSTACK_MAX_LIMIT ? limit : NUMSTACK_MAX_LIMIT;
+    if (stack->cap > stack->limit)
+        stack->cap = stack->limit;
+    return stack;
 }
 
-number numstack_pop(numstack* stack) {
-    if (stack->offset <= 0) {
-        fprintf(stderr, "Attempt to pop from empty numstack\n");
-        abort();
+#endif
+
+// The stack is left as it was if there is no memory for it. `cap` must be
+// within the limit
+void __numstack_resize(numstack* stack, size_t cap) {
+#if NUMSTACK_RESERVE_SUPPORTED
+    size_t size = __round_to_pages((cap + NUMSTACK_SCRATCH)*sizeof(number));
+    if (stack->reserved > 0 && size > stack->reserved)
+        __numstack_extend(stack, size);
+    if (stack->reserved > 0) {
+        __numstack_commit(stack, cap);
+        return;
     }
+#endif
+
+    number* new_data = reallocate(stack->allocator, stack->data - NUMSTACK_SCRATCH,
+                                  (cap + NUMSTACK_SCRATCH)*sizeof(number));
+    if (!new_data)
+        out_of_memory(stack->allocator, "expand numstack");
+
+    stack->data = new_data + NUMSTACK_SCRATCH;
+    stack->cap = cap;
+    stats_add(STATS_numstack_resizes, 1);
+}
 
-    stack->offset--;
-    return stack->data[stack->offset];
+bool numstack_reserve(numstack* stack, size_t cap) {
+    if (cap > stack->limit) return false;
+    if (cap <= stack->cap) return true;
+
+    size_t new_cap = stack->cap > 0 ? stack->cap : 1;
+    while (new_cap < cap)
+        new_cap *= 2;
+    __numstack_resize(stack, new_cap < stack->limit ? new_cap : stack->limit);
+    return true;
+}
+
+void numstack_grow(numstack* stack) {
+    if (stack->cap >= stack->limit)
+        out_of_memory(stack->allocator, "grow numstack past its limit");
+    size_t cap = stack->cap > 0 ? stack->cap*2 : 1;
+    __numstack_resize(stack, cap < stack->limit ? cap : stack->limit);
+}
+
+void numstack_underflow(void) {
+    fprintf(stderr, "Attempt to pop from empty numstack\n");
+    abort();
+}
+
+void numstack_deinit(numstack* stack) {
+    const Allocator* allocator = stack->allocator;
+#if NUMSTACK_RESERVE_SUPPORTED
+    if (stack->reserved > 0)
+        munmap(stack->data - NUMSTACK_SCRATCH, stack->reserved);
+    else
+#endif
+    release(allocator, stack->data - NUMSTACK_SCRATCH);
+    release(allocator, stack);
 }
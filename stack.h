@@ -1,17 +1,64 @@
 #ifndef STACK_H
 #define STACK_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "allocator.h"
 #include "number.h"
 
+// Stacks can reserve address space and commit pages as they grow, which
+// does not copy them until they outgrow the reservation, where mmap() is at
+// hand and addresses are wide enough to spare
+#if defined(__unix__) && UINTPTR_MAX > 0xffffffff && !defined(CCALC_NO_RESERVED_STACK)
+#define NUMSTACK_RESERVE_SUPPORTED 1
+#else
+#define NUMSTACK_RESERVE_SUPPORTED 0
+#endif
+
+// data[-1] is a scratch slot, so that code caching the top value in a
+// register can write it back without checking whether there is one
 typedef struct {
     number* data;
     size_t offset;
     size_t cap;
+    size_t limit; // most values it may grow to hold
+    size_t reserved; // bytes of address space, 0 if from the allocator
+    const Allocator* allocator;
 } numstack;
 
-numstack* numstack_init(void);
+// A stack that grows with the allocator, copying itself, without limit
+numstack* numstack_init(const Allocator* allocator);
+// A stack of at most `limit` values, in reserved address space if that is
+// supported and can be had, else from the allocator. Only part of the
+// limit is reserved at first
+numstack* numstack_init_reserved(const Allocator* allocator, size_t limit);
 void numstack_deinit(numstack* stack);
-void numstack_push(numstack* stack, number num);
-number numstack_pop(numstack* stack);
+// Makes room for at least `cap` values. False, the stack being left as it
+// was, if that is over its limit
+bool numstack_reserve(numstack* stack, size_t cap);
+// The out of line halves of numstack_push() and numstack_pop()
+void numstack_grow(numstack* stack);
+void numstack_underflow(void) __attribute__((noreturn));
+
+static inline void numstack_push(numstack* stack, number num) {
+    if (__builtin_expect(stack->offset == stack->cap, 0))
+        numstack_grow(stack);
+    stack->data[stack->offset++] = num;
+}
+
+static inline number numstack_pop(numstack* stack) {
+    if (__builtin_expect(stack->offset == 0, 0))
+        numstack_underflow();
+    return stack->data[--stack->offset];
+}
+
+// For code that has made sure there is room or a value on the stack
+static inline void numstack_push_unchecked(numstack* stack, number num) {
+    stack->data[stack->offset++] = num;
+}
+
+static inline number numstack_pop_unchecked(numstack* stack) {
+    return stack->data[--stack->offset];
+}
 
 #endif /* STACK_H */
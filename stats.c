@@ -0,0 +1,131 @@
+#include "stats.h"
+#include <time.h>
+#include <sys/resource.h>
+
+Stats stats;
+bool stats_enabled = false;
+
+const char* const STATS_PHASE_NAMES[/*StatsPhase*/] = {
+#define X(name, description) \
+    [STATS_PHASE_##name] = #name,
+    STATS_PHASE_LIST
+#undef X
+};
+
+const char* const STATS_PHASE_DESCRIPTIONS[/*StatsPhase*/] = {
+#define X(name, description) \
+    [STATS_PHASE_##name] = description,
+    STATS_PHASE_LIST
+#undef X
+};
+
+const char* const STATS_COUNTER_NAMES[/*StatsCounter*/] = {
+#define X(name, description) \
+    [STATS_##name] = #name,
+    STATS_COUNTER_LIST
+#undef X
+};
+
+const char* const STATS_COUNTER_DESCRIPTIONS[/*StatsCounter*/] = {
+#define X(name, description) \
+    [STATS_##name] = description,
+    STATS_COUNTER_LIST
+#undef X
+};
+
+uint64_t __clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+uint64_t stats_start_ns = 0;
+
+#if STATS_SUPPORTED
+
+// Where each thread is and since when, 0 before its first switch
+__thread StatsPhase current_phase = STATS_PHASE_setup;
+__thread uint64_t phase_wall_ns = 0;
+__thread uint64_t phase_cpu_ns = 0;
+
+void stats_max(StatsCounter counter, uint64_t n) {
+    if (!stats_enabled) return;
+    uint64_t max = __atomic_load_n(&stats.counters[counter], __ATOMIC_RELAXED);
+    while (n > max && !__atomic_compare_exchange_n(&stats.counters[counter], &max, n, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void stats_count_tokens(const TokenList* tokens) {
+    if (!stats_enabled) return;
+    uint64_t counts[TOKEN_KIND_COUNT] = {0};
+    for (size_t i = 0; i < tokens->len; i++)
+        counts[tokens->kinds[i]]++;
+    for (TokenKind kind = TOKEN_NUMBER; kind < TOKEN_KIND_COUNT; kind++)
+        stats_add(STATS_tokens_number + kind, counts[kind]);
+    stats_add(STATS_batches, 1);
+}
+
+StatsPhase stats_enter(StatsPhase phase) {
+    StatsPhase previous = current_phase;
+    if (!stats_enabled) return previous;
+
+    uint64_t wall = __clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = __clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (phase_wall_ns > 0) {
+        __atomic_fetch_add(&stats.wall_ns[previous], wall - phase_wall_ns, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.cpu_ns[previous], cpu - phase_cpu_ns, __ATOMIC_RELAXED);
+    }
+    current_phase = phase;
+    phase_wall_ns = wall;
+    phase_cpu_ns = cpu;
+    return previous;
+}
+
+#endif
+
+void enable_stats(void) {
+    stats_enabled = true;
+    stats_start_ns = __clock_ns(CLOCK_MONOTONIC);
+    stats_enter(STATS_PHASE_setup);
+}
+
+double __rusage_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec*1e-6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec*1e-6;
+}
+
+// Phase times are summed over threads, so with several of them they can
+// add up to more than the total
+void print_stats(FILE* file, bool json) {
+    // Charges the time up to now
+    stats_enter(STATS_PHASE_setup);
+    double wall = (__clock_ns(CLOCK_MONOTONIC) - stats_start_ns)*1e-9;
+    double cpu = __rusage_seconds();
+
+    if (json) {
+        fprintf(file, "{\n  \"wall_seconds\": %.6f,\n  \"cpu_seconds\": %.6f,\n  \"phases\": {\n",
+                wall, cpu);
+        for (size_t i = 0; i < STATS_PHASE_COUNT; i++)
+            fprintf(file, "    \"%s\": {\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f}%s\n",
+                    STATS_PHASE_NAMES[i], stats.wall_ns[i]*1e-9, stats.cpu_ns[i]*1e-9,
+                    i + 1 < STATS_PHASE_COUNT ? "," : "");
+        fprintf(file, "  },\n  \"counters\": {\n");
+        for (size_t i = 0; i < STATS_COUNTER_COUNT; i++)
+            fprintf(file, "    \"%s\": %llu%s\n", STATS_COUNTER_NAMES[i],
+                    (unsigned long long) stats.counters[i], i + 1 < STATS_COUNTER_COUNT ? "," : "");
+        fprintf(file, "  }\n}\n");
+        return;
+    }
+
+    fprintf(file, "%-32s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (size_t i = 0; i < STATS_PHASE_COUNT; i++)
+        fprintf(file, "%-32s %12.3f %12.3f\n", STATS_PHASE_DESCRIPTIONS[i],
+                stats.wall_ns[i]*1e-6, stats.cpu_ns[i]*1e-6);
+    fprintf(file, "%-32s %12.3f %12.3f\n", "total", wall*1e3, cpu*1e3);
+    for (size_t i = 0; i < STATS_COUNTER_COUNT; i++)
+        fprintf(file, "%-32s %12llu\n", STATS_COUNTER_DESCRIPTIONS[i],
+                (unsigned long long) stats.counters[i]);
+}
@@ -0,0 +1,124 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "lexer.h"
+
+// Counters and per-phase timings reported by --stats. Nothing is counted
+// per token or per operation, only per batch, read, write or allocation,
+// so they cost next to nothing when on. Building with CCALC_NO_STATS
+// removes them altogether, as libccalc is built: the counters below are
+// shared by the whole process, not by one CCalc context
+#ifndef CCALC_NO_STATS
+#define STATS_SUPPORTED 1
+#else
+#define STATS_SUPPORTED 0
+#endif
+
+// Time is charged to the phase a thread is in, phases nesting without
+// being counted twice
+#define STATS_PHASE_LIST \
+    X(setup, "setup and teardown") \
+    X(read, "reading input") \
+    X(lex, "lexing and number conversion") \
+    X(verify, "verification") \
+    X(optimize, "optimization") \
+    X(compile, "compilation to bytecode") \
+    X(run, "interpretation and formatting") \
+    X(write, "writing output")
+
+typedef enum {
+#define X(name, description) \
+    STATS_PHASE_##name,
+    STATS_PHASE_LIST
+#undef X
+    STATS_PHASE_COUNT
+} StatsPhase;
+
+// Tokens come in TokenKind order
+#define STATS_COUNTER_LIST \
+    X(bytes_read, "bytes of input") \
+    X(tokens_number, "number tokens") \
+    X(tokens_addition, "+ tokens") \
+    X(tokens_subtraction, "- tokens") \
+    X(tokens_multiplication, "* tokens") \
+    X(tokens_division, "/ tokens") \
+    X(tokens_print, "= tokens") \
+    X(tokens_column, "$ tokens") \
+    X(tokens_sum, ".+ tokens") \
+    X(tokens_product, ".* tokens") \
+    X(tokens_min, ".< tokens") \
+    X(tokens_max, ".> tokens") \
+    X(tokens_mean, "./ tokens") \
+    X(slow_numbers, "numbers converted the slow way") \
+    X(batches, "token batches") \
+    X(allocations, "allocations") \
+    X(reallocations, "reallocations") \
+    X(releases, "releases") \
+    X(bytes_allocated, "bytes allocated or reallocated") \
+    X(numstack_resizes, "numstack resizes") \
+    X(numstack_max_depth, "numstack maximum depth") \
+    X(bytes_written, "bytes of output") \
+    X(writes, "write calls")
+
+typedef enum {
+#define X(name, description) \
+    STATS_##name,
+    STATS_COUNTER_LIST
+#undef X
+    STATS_COUNTER_COUNT
+} StatsCounter;
+
+typedef struct {
+    uint64_t counters[STATS_COUNTER_COUNT];
+    uint64_t wall_ns[STATS_PHASE_COUNT]; // summed over threads
+    uint64_t cpu_ns[STATS_PHASE_COUNT];
+} Stats;
+
+extern Stats stats;
+extern bool stats_enabled;
+
+#if STATS_SUPPORTED
+
+static inline void stats_add(StatsCounter counter, uint64_t n) {
+    if (stats_enabled)
+        __atomic_fetch_add(&stats.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_max(StatsCounter counter, uint64_t n);
+// Counts a batch and its tokens by kind
+void stats_count_tokens(const TokenList* tokens);
+// Charges the time since the calling thread's last switch to the phase
+// it was in, returning that phase to switch back to
+StatsPhase stats_enter(StatsPhase phase);
+
+#else
+
+static inline void stats_add(StatsCounter counter, uint64_t n) {
+    (void) counter;
+    (void) n;
+}
+
+static inline void stats_max(StatsCounter counter, uint64_t n) {
+    (void) counter;
+    (void) n;
+}
+
+static inline void stats_count_tokens(const TokenList* tokens) {
+    (void) tokens;
+}
+
+static inline StatsPhase stats_enter(StatsPhase phase) {
+    return phase;
+}
+
+#endif
+
+// Starts counting, the calling thread being in the setup phase
+void enable_stats(void);
+// Phase timings, counters, total wall time and process CPU time
+void print_stats(FILE* file, bool json);
+
+#endif /* STATS_H */
@@ -0,0 +1,181 @@
+#!/bin/sh
+# Runs one program in ways that must agree and fails on any difference.
+# Usage: differential.sh CHECK CCALC BACKEND, CHECK being
+#   map    - --map rows with --jit, on the SIMD lanes and one row at a time
+#   lexer  - a large file lexed on one thread and on several
+#   format - printed numbers read back as the same value
+#   server - programs run by the daemon and by ccalc itself
+set -u
+
+check=$1
+ccalc=$2
+backend=$3
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+# Pseudo-random lines from awk, the same on every run. $1 is the seed
+generate() {
+    awk -v seed="$1" "BEGIN { srand(seed); $2 }"
+}
+
+# stdout, stderr and the exit status of running ccalc with the arguments,
+# into $work/$1
+run() {
+    out=$1
+    shift
+    "$ccalc" "$@" > "$work/$out.out" 2> "$work/$out.err"
+    echo $? >> "$work/$out.err"
+}
+
+check_map() {
+    # Repeated past several 1024 row blocks, with a short one at the end
+    cp "$tests/map_rows.txt" "$work/rows"
+    for i in $(seq 80); do cat "$tests/map_rows.txt"; done > "$work/many_rows"
+
+    n=0
+    while IFS= read -r program; do
+        n=$((n + 1))
+        for rows in rows many_rows; do
+            run lanes --map="$program" "$work/$rows"
+            run jit --jit --map="$program" "$work/$rows"
+            cmp -s "$work/lanes.out" "$work/jit.out" && cmp -s "$work/lanes.err" "$work/jit.err" \
+                || fail "program $n on $rows: --jit differs from the lanes"
+        done
+
+        # A program of its own for every row, $N replaced by the field
+        : > "$work/rows.out"
+        while IFS= read -r row; do
+            text=$(echo "$row" | awk -v program="$program" '{
+                count = split(program, tokens, " ")
+                text = ""
+                for (i = 1; i <= count; i++) {
+                    if (tokens[i] ~ /^\$[0-9]+$/) {
+                        field = substr(tokens[i], 2) + 0
+                        if (field > NF) { text = "MISSING"; break }
+                        tokens[i] = $field
+                    }
+                    text = text tokens[i] " "
+                }
+                print text
+            }')
+            if [ "$text" != MISSING ] && echo "$text" | "$ccalc" > "$work/row.out" 2> /dev/null; then
+                paste -s -d ' ' "$work/row.out" >> "$work/rows.out"
+            else
+                echo >> "$work/rows.out"
+            fi
+        done < "$work/rows"
+        "$ccalc" --map="$program" "$work/rows" 2> /dev/null | cmp -s - "$work/rows.out" \
+            || fail "program $n: --map differs from running every row on its own"
+    done < "$tests/map_programs.txt"
+}
+
+# Lines of `a b op =` and reductions between words the lexer skips, long
+# enough to be split in several chunks
+generate_program() {
+    generate "$1" '
+        split("+ - * /", ops, " ")
+        split("x foo a=b # ; , ? ", words, " ")
+        for (line = 0; line < 1000000; line++) {
+            a = int(rand() * 2000) - 1000
+            b = int(rand() * 999) + 1
+            if (rand() < 0.3) a = a "." int(rand() * 1000)
+            if (rand() < 0.1) b = b "e" int(rand() * 3)
+            printf "%s\t%s %s =", a, b, ops[int(rand() * 4) + 1]
+            if (rand() < 0.2) printf " %s", words[int(rand() * 8) + 1]
+            if (rand() < 0.05) printf "\n1 2 3 4 3.+ .* ="
+            printf "\n"
+        }'
+}
+
+check_lexer() {
+    generate_program 1 > "$work/program"
+    # The same with a division by zero in the middle
+    awk 'NR == 500000 { print "7 0 / =" } { print }' "$work/program" > "$work/failing"
+    for program in program failing; do
+        run one "$work/$program"
+        run four --jobs=4 "$work/$program"
+        cmp -s "$work/one.out" "$work/four.out" && cmp -s "$work/one.err" "$work/four.err" \
+            || fail "$program: lexing on 4 threads differs from 1"
+    done
+}
+
+check_format() {
+    case $backend in
+    float|double) values='
+        digits = ""
+        for (d = int(rand() * 17) + 1; d > 0; d--) digits = digits int(rand() * 10)
+        v = "0." digits "e" (int(rand() * 60) - 30)' ;;
+    int64) values='
+        v = sprintf("%.0f", int(rand() * 1e15) - int(rand() * 1e15))' ;;
+    *) values='
+        v = sprintf("%.0f.%06d", int(rand() * 1e9) - int(rand() * 1e9), int(rand() * 1e6))' ;;
+    esac
+    generate 2 "for (i = 0; i < 100000; i++) { $values; if (rand() < 0.5 && v !~ /^-/) v = \"-\" v; print v, \"=\" }" \
+        > "$work/values"
+    "$ccalc" "$work/values" > "$work/printed" || fail "could not print the values"
+    # Every value minus what it printed as
+    paste -d ' ' "$work/values" "$work/printed" | awk '{ print $1, $3, "- =" }' \
+        | "$ccalc" > "$work/differences" || fail "could not read the printed values"
+    zeros=$(grep -c -x 0 "$work/differences")
+    [ "$zeros" = 100000 ] || fail "$((100000 - zeros)) values read back differently from how they printed"
+
+    # Infinities, which have no difference to take, must print the same
+    # once read back
+    case $backend in
+    float|double)
+        echo '1e999 = -1e999 = 1e200 1e200 * = -1e200 1e200 * =' | "$ccalc" > "$work/printed"
+        sed 's/$/ =/' "$work/printed" | "$ccalc" | cmp -s - "$work/printed" \
+            || fail "infinities read back differently from how they printed" ;;
+    esac
+}
+
+check_server() {
+    "$ccalc" --serve="$work/socket" 2> /dev/null &
+    server=$!
+    for i in $(seq 50); do
+        [ -S "$work/socket" ] && break
+        sleep 0.1
+    done
+
+    # A file per line of tests/programs.txt, each run on its own
+    n=0
+    files=
+    while IFS= read -r program; do
+        n=$((n + 1))
+        echo "$program" > "$work/$n.rpn"
+        files="$files $work/$n.rpn"
+        run local "$work/$n.rpn"
+        run remote --remote="$work/socket" "$work/$n.rpn"
+        cmp -s "$work/local.out" "$work/remote.out" && cmp -s "$work/local.err" "$work/remote.err" \
+            || fail "program $n: the daemon differs from ccalc"
+    done < "$tests/programs.txt"
+
+    # All of them over one connection, stopping at the first that fails
+    : > "$work/local.out"
+    : > "$work/local.err"
+    for file in $files; do
+        "$ccalc" "$file" >> "$work/local.out" 2>> "$work/local.err" || break
+    done
+    "$ccalc" --remote="$work/socket" $files > "$work/remote.out" 2> "$work/remote.err"
+    cmp -s "$work/local.out" "$work/remote.out" && cmp -s "$work/local.err" "$work/remote.err" \
+        || fail "one connection for every program differs from ccalc"
+
+    kill "$server"
+    wait "$server"
+}
+
+case $check in
+map) check_map ;;
+lexer) check_lexer ;;
+format) check_format ;;
+server) check_server ;;
+*) echo "Unknown check '$check'"; exit 2 ;;
+esac
+exit $failed
@@ -0,0 +1,109 @@
+#include "verifier.h"
+#include "program.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Values each token kind pops from and pushes to the stack, at least for
+// reductions
+const struct {
+    size_t pops;
+    size_t pushes;
+} TOKEN_STACK_EFFECT[/*TokenKind*/] = {
+    [TOKEN_NUMBER] = {0, 1},
+    [TOKEN_ADDITION] = {2, 1},
+    [TOKEN_SUBTRACTION] = {2, 1},
+    [TOKEN_MULTIPLICATION] = {2, 1},
+    [TOKEN_DIVISION] = {2, 1},
+    [TOKEN_PRINT] = {1, 0},
+    [TOKEN_COLUMN] = {0, 1},
+    [TOKEN_SUM] = {1, 1},
+    [TOKEN_PRODUCT] = {1, 1},
+    [TOKEN_MIN] = {1, 1},
+    [TOKEN_MAX] = {1, 1},
+    [TOKEN_MEAN] = {1, 1},
+};
+
+// Checks that the tokens never pop from an empty stack when run on a stack
+// `depth` values deep, before any of them is run. Column references only
+// have a value in map mode. Returns the deepest the stack gets, which is
+// enough to run them without bounds checks. Stops at the first error
+size_t verify_token_list(TokenList* tokens, size_t depth, bool allow_columns, Error* error) {
+    size_t max_depth = depth;
+
+    for (size_t i = 0; i < tokens->len; i++) {
+        unsigned char kind = tokens->kinds[i];
+        if (kind == TOKEN_COLUMN && !allow_columns) {
+            raise_error(error, CCALC_ERROR_COLUMN, "Column reference outside of map mode (token %zu)",
+                        tokens->first + i + 1);
+            break;
+        }
+        size_t pops = TOKEN_STACK_EFFECT[kind].pops;
+        if (token_kind_is_reduction(kind))
+            pops = reduction_pops(tokens->operands[i], depth);
+        if (depth < pops) {
+            raise_error(error, CCALC_ERROR_STACK_UNDERFLOW, "Not enough values on stack for '%s' (token %zu)",
+                        TOKEN_TEXT[kind], tokens->first + i + 1);
+            break;
+        }
+        depth += TOKEN_STACK_EFFECT[kind].pushes - pops;
+        if (depth > max_depth)
+            max_depth = depth;
+    }
+
+    return max_depth;
+}
+
+const struct {
+    size_t pops;
+    size_t pushes;
+    bool immediate;
+} OPCODE_STACK_EFFECT[/*Opcode*/] = {
+#define X(op, pops, pushes, imm) \
+    [op] = {pops, pushes, imm},
+    OPCODE_LIST
+#undef X
+};
+
+// The same for code that did not come from the compiler: every opcode
+// must be known, immediates complete, and OP_HALT only at the very end
+size_t verify_code(const unsigned char* code, size_t len, size_t depth, Error* error) {
+    size_t max_depth = depth;
+
+    size_t i = 0;
+    while (i < len) {
+        unsigned char op = code[i];
+        if (op >= OPCODE_COUNT) {
+            raise_error(error, CCALC_ERROR_BYTECODE, "Unknown opcode %u (byte %zu)", op, i);
+            break;
+        }
+        if (op == OP_HALT)
+            break;
+        if (OPCODE_STACK_EFFECT[op].immediate && len - i - 1 < sizeof(number)) {
+            raise_error(error, CCALC_ERROR_BYTECODE, "Truncated instruction (byte %zu)", i);
+            break;
+        }
+        size_t pops = OPCODE_STACK_EFFECT[op].pops;
+        if (opcode_is_reduction(op)) {
+            number count;
+            memcpy(&count, code + i + 1, sizeof(number));
+            // Also false for NaN
+            if (!(count >= 0 && count <= MAX_REDUCTION_COUNT) || count != (number) (size_t) count) {
+                raise_error(error, CCALC_ERROR_BYTECODE, "Invalid reduction count (byte %zu)", i);
+                break;
+            }
+            pops = reduction_pops(count, depth);
+        }
+        if (depth < pops) {
+            raise_error(error, CCALC_ERROR_STACK_UNDERFLOW, "Not enough values on stack (byte %zu)", i);
+            break;
+        }
+        depth += OPCODE_STACK_EFFECT[op].pushes - pops;
+        if (depth > max_depth)
+            max_depth = depth;
+        i += 1 + (OPCODE_STACK_EFFECT[op].immediate ? sizeof(number) : 0);
+    }
+
+    if (!error_raised(error) && i != len - 1)
+        raise_error(error, CCALC_ERROR_BYTECODE, "Code does not end with its only halt");
+    return max_depth;
+}
@@ -0,0 +1,12 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "error.h"
+#include "lexer.h"
+
+size_t verify_token_list(TokenList* tokens, size_t depth, bool allow_columns, Error* error);
+size_t verify_code(const unsigned char* code, size_t len, size_t depth, Error* error);
+
+#endif /* VERIFIER_H */